@@ -0,0 +1,1105 @@
+﻿#include <cmath>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+
+#include <new>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <iomanip>
+#include <iostream>
+#include <filesystem>
+
+#include "kdtree.h"
+#include "flat_kdtree.h"
+#include "point.h"
+#include "tools.h"
+#include "io.h"
+
+using Point2D = Point<int, double, 2>;
+
+//
+// Подсчёт динамической памяти, чтобы оценить
+// её расход на одну точку для разных деревьев.
+//
+
+namespace
+{
+
+std::atomic<std::size_t> allocated_bytes{0};
+std::atomic<std::size_t> peak_bytes{0};
+std::atomic<std::size_t> num_allocations{0};
+
+// Размер блока хранится перед ним самим, поэтому
+// выравнивание сохраняется таким же, как у malloc.
+constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+
+}
+
+void* operator new(std::size_t size)
+{
+    auto* block = static_cast<unsigned char*>(std::malloc(size + HEADER_SIZE));
+    if (!block)
+        throw std::bad_alloc();
+
+    *reinterpret_cast<std::size_t*>(block) = size;
+    ++num_allocations;
+
+    const std::size_t bytes = allocated_bytes += size;
+    for (std::size_t peak = peak_bytes; peak < bytes;)
+        if (peak_bytes.compare_exchange_weak(peak, bytes))
+            break;
+
+    return block + HEADER_SIZE;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (!pointer)
+        return;
+
+    auto* block = static_cast<unsigned char*>(pointer) - HEADER_SIZE;
+    allocated_bytes -= *reinterpret_cast<std::size_t*>(block);
+
+    std::free(block);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    operator delete(pointer);
+}
+
+namespace
+{
+
+std::vector<Point2D> makePoints(std::size_t num_points,
+                              int range,
+                              std::uint32_t seed)
+{
+    std::mt19937 engine{seed};
+    std::uniform_int_distribution<int> coord{-range, range};
+    std::uniform_real_distribution<double> value{-100.0, 100.0};
+
+    std::vector<Point2D> points;
+    points.reserve(num_points);
+    for (std::size_t i = 0; i < num_points; ++i)
+        points.push_back({{coord(engine), coord(engine)}, value(engine)});
+
+    return points;
+}
+
+// Приёмник результата пакетной интерполяции, который его отбрасывает
+struct NullSink
+{
+    void write(const Point2D&) noexcept
+    {
+    }
+};
+
+template<class Function>
+double measure(Function&& function)
+{
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
+
+template<class Tree, class... Types>
+void benchmarkTree(const std::string& name,
+                   const std::vector<Point2D>& points,
+                   const std::vector<Point2D>& queries,
+                   std::size_t num_neighbors,
+                   Types... arguments)
+{
+    const std::size_t base_bytes = allocated_bytes;
+
+    Tree tree;
+    const double build_time = measure([&](){
+        tree = Tree{std::vector<Point2D>{points}, arguments...}; });
+
+    const double bytes_per_point = static_cast<double>(allocated_bytes - base_bytes)
+                                 / points.size();
+
+    std::size_t checksum = 0;
+    const double search_time = measure([&](){
+        for (const auto& query : queries)
+            checksum += tree.neighborsSearch(query, num_neighbors, false).size(); });
+
+    auto targets = queries;
+    const double idw_time = measure([&](){
+        for (auto& target : targets)
+            tree.shepardInterpolation(target, num_neighbors, false, 2.0); });
+
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(12) << points.size()
+              << std::setw(8) << num_neighbors
+              << std::setw(12) << bytes_per_point
+              << std::setw(12) << build_time * 1.0E3
+              << std::setw(12) << search_time * 1.0E6 / queries.size()
+              << std::setw(12) << idw_time * 1.0E6 / queries.size()
+              << (checksum == queries.size() * num_neighbors ? "" : "  (!)")
+              << '\n';
+}
+
+// Расход памяти на точку и задержка запроса для дерева на указателях
+// (KdTree) и для дерева в виде одного непрерывного массива (FlatKdTree)
+void benchmarkLayout(std::size_t num_points,
+                     std::size_t num_queries,
+                     std::size_t num_neighbors)
+{
+    const auto points = makePoints(num_points, 1'000'000, 1);
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    benchmarkTree<KdTree<Point2D>>("KdTree", points, queries, num_neighbors);
+    benchmarkTree<FlatKdTree<Point2D>>("FlatKdTree", points, queries, num_neighbors);
+}
+
+// Вычисление ОВР по уже найденным соседям при разных степенях: целые и
+// полуцелые вычисляются специализированными ядрами, остальные - через pow()
+void benchmarkIdwPower(std::size_t num_points,
+                       std::size_t num_queries,
+                       std::size_t num_neighbors)
+{
+    const auto points = makePoints(num_points, 1'000'000, 23);
+    const auto queries = makePoints(num_queries, 1'000'000, 24);
+
+    const FlatKdTree<Point2D> tree{std::vector<Point2D>{points}, FlatKdTree<Point2D>::INDEX_LEAF_SIZE};
+    std::vector<std::vector<Point2D>> neighbors;
+    neighbors.reserve(queries.size());
+    for (const auto& query : queries)
+        neighbors.push_back(tree.neighborsSearch(query, num_neighbors, false));
+
+    for (double idw_power : {1.0, 2.0, 3.0, 2.5, 1.7})
+    {
+        double checksum = 0.0;
+        const double idw_time = measure([&](){
+            for (std::size_t i = 0; i < queries.size(); ++i)
+                checksum += shepardInterpolation(queries[i], neighbors[i], idw_power); });
+
+        std::cout << std::right << std::setw(12) << idw_power
+                  << std::setw(8) << num_neighbors
+                  << std::setw(16) << idw_time * 1.0E9 / (queries.size() * num_neighbors)
+                  << (std::isfinite(checksum) ? "" : "  (!)")
+                  << '\n';
+    }
+}
+
+// Запрос с копированием соседей в вектор и без него (через посетителя)
+template<class Tree>
+void benchmarkQueryForm(const std::string& name,
+                        const std::vector<Point2D>& points,
+                        const std::vector<Point2D>& queries,
+                        std::size_t num_neighbors)
+{
+    const Tree tree{std::vector<Point2D>{points}};
+
+    std::size_t vector_checksum = 0, visitor_checksum = 0;
+    const double vector_time = measure([&](){
+        for (const auto& query : queries)
+            vector_checksum += tree.neighborsSearch(query, num_neighbors, false).size(); });
+
+    const double visitor_time = measure([&](){
+        for (const auto& query : queries)
+            visitor_checksum += tree.visitNeighbors(query, num_neighbors, false,
+                                                    [](auto, const Point2D*){}); });
+
+    auto targets = queries;
+    const double shepard_time = measure([&](){
+        for (auto& target : targets)
+            tree.shepardInterpolation(target, num_neighbors, false, 2.0); });
+
+    double checksum = 0.0;
+    const double value_time = measure([&](){
+        for (const auto& query : queries)
+            checksum += tree.interpolate(query, num_neighbors, false, 2.0); });
+
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(8) << num_neighbors
+              << std::setw(12) << vector_time * 1.0E6 / queries.size()
+              << std::setw(12) << visitor_time * 1.0E6 / queries.size()
+              << std::setw(12) << shepard_time * 1.0E6 / queries.size()
+              << std::setw(12) << value_time * 1.0E6 / queries.size()
+              << (vector_checksum == visitor_checksum && std::isfinite(checksum) ? "" : "  (!)")
+              << '\n';
+}
+
+void benchmarkQueryForms(std::size_t num_points,
+                         std::size_t num_queries,
+                         std::size_t num_neighbors)
+{
+    const auto points = makePoints(num_points, 1'000'000, 25);
+    const auto queries = makePoints(num_queries, 1'000'000, 26);
+
+    benchmarkQueryForm<KdTree<Point2D>>("KdTree", points, queries, num_neighbors);
+    benchmarkQueryForm<FlatKdTree<Point2D>>("FlatKdTree", points, queries, num_neighbors);
+}
+
+// Выделения памяти на запрос с временным рабочим пространством и с одним
+// пространством на все запросы: после прогрева их не должно быть вообще
+template<class Tree>
+void benchmarkWorkspace(const std::string& name,
+                        const std::vector<Point2D>& points,
+                        const std::vector<Point2D>& queries,
+                        std::size_t num_neighbors)
+{
+    const Tree tree{std::vector<Point2D>{points}};
+    typename Tree::QueryWorkspace workspace;
+
+    double checksum = tree.interpolate(workspace, queries.front(), num_neighbors, false, 2.0);
+
+    std::size_t base_allocations = num_allocations;
+    const double temporary_time = measure([&](){
+        for (const auto& query : queries)
+            checksum += tree.interpolate(query, num_neighbors, false, 2.0); });
+    const std::size_t temporary_allocations = num_allocations - base_allocations;
+
+    base_allocations = num_allocations;
+    const double reused_time = measure([&](){
+        for (const auto& query : queries)
+            checksum += tree.interpolate(workspace, query, num_neighbors, false, 2.0); });
+    const std::size_t reused_allocations = num_allocations - base_allocations;
+
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(8) << num_neighbors
+              << std::setw(12) << temporary_time * 1.0E6 / queries.size()
+              << std::setw(12) << static_cast<double>(temporary_allocations) / queries.size()
+              << std::setw(12) << reused_time * 1.0E6 / queries.size()
+              << std::setw(12) << static_cast<double>(reused_allocations) / queries.size()
+              << (reused_allocations == 0 && std::isfinite(checksum) ? "" : "  (!)")
+              << '\n';
+}
+
+void benchmarkWorkspaces(std::size_t num_points,
+                         std::size_t num_queries,
+                         std::size_t num_neighbors)
+{
+    const auto points = makePoints(num_points, 1'000'000, 27);
+    const auto queries = makePoints(num_queries, 1'000'000, 28);
+
+    benchmarkWorkspace<KdTree<Point2D>>("KdTree", points, queries, num_neighbors);
+    benchmarkWorkspace<FlatKdTree<Point2D>>("FlatKdTree", points, queries, num_neighbors);
+}
+
+// Листья-корзины разного размера с векторизованным просмотром
+void benchmarkLeafSize(std::size_t num_points,
+                       std::size_t num_queries,
+                       std::size_t num_neighbors)
+{
+    const auto points = makePoints(num_points, 1'000'000, 1);
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    for (std::size_t leaf_size : {1UL, 8UL, 16UL, 32UL, 64UL})
+        benchmarkTree<FlatKdTree<Point2D>>("Flat/" + std::to_string(leaf_size),
+                                           points, queries, num_neighbors, leaf_size);
+}
+
+// Время построения и пиковый расход памяти сверх входных данных
+template<class Tree, class... Types>
+void benchmarkBuild(const std::string& name,
+                    std::size_t num_points,
+                    Types... arguments)
+{
+    auto points = makePoints(num_points, 1'000'000'000, 3);
+
+    const std::size_t base_bytes = allocated_bytes;
+    peak_bytes = base_bytes;
+
+    double build_time;
+    {
+        Tree tree;
+        build_time = measure([&](){
+            tree = Tree{std::move(points), arguments...}; });
+    }
+
+    const std::size_t input_bytes = num_points * sizeof(Point2D);
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(12) << num_points
+              << std::setw(12) << build_time * 1.0E3
+              << std::setw(16) << static_cast<double>(peak_bytes - base_bytes + input_bytes)
+                                  / input_bytes
+              << '\n';
+}
+
+// Масштабирование пакетной интерполяции по числу потоков
+void benchmarkBatch(std::size_t num_points,
+                    std::size_t num_queries,
+                    std::size_t num_neighbors)
+{
+    const FlatKdTree tree{makePoints(num_points, 1'000'000, 1), FlatKdTree<Point2D>::INDEX_LEAF_SIZE};
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    std::cout << "\x1b[1;44mBatch:\x1b[0m\n"
+              << std::setw(12) << "threads"
+              << std::setw(12) << "queries"
+              << std::setw(8) << "k"
+              << std::setw(12) << "total, ms"
+              << std::setw(12) << "speedup"
+              << '\n';
+
+    double serial_time = 0.0;
+    for (std::size_t num_threads = 1;
+         num_threads <= std::max(std::thread::hardware_concurrency(), 1U);
+         num_threads *= 2)
+    {
+        auto points = queries;
+        NullSink sink;
+        const double time = measure([&](){
+            shepardInterpolation(tree, points, num_neighbors, false, 0.0, 2.0, 0.0, num_threads,
+                                 true, -1, std::array{"x", "y"}, "value", sink); });
+
+        if (num_threads == 1)
+            serial_time = time;
+
+        std::cout << std::setw(12) << num_threads
+                  << std::setw(12) << num_queries
+                  << std::setw(8) << num_neighbors
+                  << std::setw(12) << time * 1.0E3
+                  << std::setw(12) << serial_time / time
+                  << '\n';
+    }
+}
+
+// Время на запрос при обработке в исходном (случайном) порядке
+// и в порядке обхода кривой Мортона, включая её построение
+void benchmarkMorton(std::size_t num_points,
+                     std::size_t num_queries,
+                     std::size_t num_neighbors)
+{
+    const FlatKdTree tree{makePoints(num_points, 1'000'000, 1), FlatKdTree<Point2D>::INDEX_LEAF_SIZE};
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    for (bool morton_order : {false, true})
+    {
+        auto points = queries;
+        NullSink sink;
+        const double time = measure([&](){
+            shepardInterpolation(tree, points, num_neighbors, false, 0.0, 2.0, 0.0, 1,
+                                 morton_order, -1, std::array{"x", "y"}, "value", sink); });
+
+        std::cout << std::left << std::setw(12) << (morton_order ? "morton" : "random") << std::right
+                  << std::setw(12) << num_points
+                  << std::setw(12) << num_queries
+                  << std::setw(8) << num_neighbors
+                  << std::setw(12) << time * 1.0E6 / num_queries
+                  << '\n';
+    }
+}
+
+// Ускорение приближённого поиска и погрешность ОВР относительно точного
+// (значения опорных точек равномерно распределены от -100 до 100)
+template<class Tree, class... Types>
+void benchmarkApprox(const std::string& name,
+                     std::size_t num_points,
+                     std::size_t num_queries,
+                     std::size_t num_neighbors,
+                     Types... arguments)
+{
+    const Tree tree{makePoints(num_points, 1'000'000, 1), arguments...};
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    std::vector<Point2D> exact;
+    double exact_time = 0.0;
+    for (double approx_epsilon : {0.0, 0.1, 0.25, 0.5, 1.0, 2.0})
+    {
+        auto targets = queries;
+        const double time = measure([&](){
+            for (auto& target : targets)
+                tree.shepardInterpolation(target, num_neighbors, false, 2.0, approx_epsilon); });
+
+        if (exact.empty())
+        {
+            exact = targets;
+            exact_time = time;
+        }
+
+        double mean_error = 0.0, max_error = 0.0;
+        for (std::size_t i = 0; i < num_queries; ++i)
+        {
+            const double error = std::abs(targets[i].getValue() - exact[i].getValue());
+            mean_error += error / num_queries;
+            max_error = std::max(max_error, error);
+        }
+
+        std::cout << std::left << std::setw(12) << name << std::right
+                  << std::setw(12) << num_points
+                  << std::setw(8) << num_neighbors
+                  << std::setw(12) << approx_epsilon
+                  << std::setw(12) << time * 1.0E6 / num_queries
+                  << std::setw(12) << exact_time / time
+                  << std::setw(12) << std::setprecision(5) << mean_error
+                  << std::setw(12) << max_error << std::setprecision(2)
+                  << '\n';
+    }
+}
+
+// Задержка отдельных запросов (медиана, 99-й перцентиль и максимум) при
+// поиске в глубину и best-bin-first с разным бюджетом. Один процент
+// запросов далеко за пределами области точек - это самые долгие запросы.
+template<class Tree, class... Types>
+void benchmarkBudget(const std::string& name,
+                     std::size_t num_points,
+                     std::size_t num_queries,
+                     std::size_t num_neighbors,
+                     Types... arguments)
+{
+    const Tree tree{makePoints(num_points, 1'000'000, 1), arguments...};
+
+    auto queries = makePoints(num_queries, 1'000'000, 2);
+    const auto far_queries = makePoints(num_queries / 100, 100'000'000, 3);
+    std::copy(far_queries.begin(), far_queries.end(), queries.begin());
+
+    std::vector<std::vector<Point2D>> expected;
+    for (const auto& query : queries)
+        expected.push_back(tree.neighborsSearch(query, num_neighbors, false));
+
+    auto printRow = [&](const std::string& method,
+                        std::vector<double>& times,
+                        std::size_t num_exact,
+                        std::size_t num_found){
+        std::sort(times.begin(), times.end());
+        std::cout << std::left << std::setw(12) << name << std::setw(12) << method << std::right
+                  << std::setw(8) << num_neighbors
+                  << std::setw(12) << times[times.size() / 2] * 1.0E6
+                  << std::setw(12) << times[times.size() * 99 / 100] * 1.0E6
+                  << std::setw(12) << times.back() * 1.0E6
+                  << std::setw(12) << 100.0 * num_exact / num_queries
+                  << std::setw(12) << 100.0 * num_found / (num_queries * num_neighbors)
+                  << '\n';
+    };
+
+    std::vector<double> times(num_queries);
+    for (std::size_t i = 0; i < num_queries; ++i)
+        times[i] = measure([&](){ tree.neighborsSearch(queries[i], num_neighbors, false); });
+    printRow("dfs", times, num_queries, num_queries * num_neighbors);
+
+    for (std::size_t max_checks : {0UL, 2000UL, 500UL, 100UL})
+    {
+        std::size_t num_exact = 0, num_found = 0;
+        for (std::size_t i = 0; i < num_queries; ++i)
+        {
+            bool exact = false;
+            std::vector<Point2D> neighbors;
+            times[i] = measure([&](){
+                neighbors = tree.bestBinFirstSearch(queries[i], num_neighbors, max_checks, exact); });
+
+            // Найденные соседи не дальше настоящего k-го
+            const double max_distance = expected[i].back().getDistance(queries[i]);
+            num_exact += exact;
+            num_found += std::count_if(neighbors.begin(), neighbors.end(),
+                                       [&](const Point2D& neighbor){
+                                           return neighbor.getDistance(queries[i]) <= max_distance; });
+        }
+
+        printRow("bbf/" + std::to_string(max_checks), times, num_exact, num_found);
+    }
+}
+
+// Поиск в радиусе с сохранением точек в один и тот же буфер и только
+// их подсчёт, а также k ближайших для того же среднего числа соседей
+template<class Tree, class... Types>
+void benchmarkRadius(const std::string& name,
+                     std::size_t num_points,
+                     std::size_t num_queries,
+                     double radius,
+                     Types... arguments)
+{
+    const Tree tree{makePoints(num_points, 1'000'000, 1), arguments...};
+    const auto queries = makePoints(num_queries, 1'000'000, 2);
+
+    std::vector<const Point2D*> buffer;
+    std::size_t num_found = 0;
+    const double search_time = measure([&](){
+        for (const auto& query : queries)
+            num_found += tree.radiusSearch(query, radius, buffer); });
+
+    std::size_t num_counted = 0;
+    const double count_time = measure([&](){
+        for (const auto& query : queries)
+            num_counted += tree.rangeCount(query, radius); });
+
+    const std::size_t num_neighbors = std::max<std::size_t>(num_found / num_queries, 1);
+    const double knn_time = measure([&](){
+        for (const auto& query : queries)
+            tree.neighborsSearch(query, num_neighbors, false); });
+
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(12) << num_points
+              << std::setw(12) << radius
+              << std::setw(12) << static_cast<double>(num_found) / num_queries
+              << std::setw(12) << search_time * 1.0E6 / num_queries
+              << std::setw(12) << count_time * 1.0E6 / num_queries
+              << std::setw(12) << knn_time * 1.0E6 / num_queries
+              << (num_found == num_counted ? "" : "  (!)")
+              << '\n';
+}
+
+// Поток точек, поступающих по одной в порядке возрастания первой координаты
+// (как при развёртке датчика), вперемешку с запросами и удалением самых
+// старых точек. Для каждой фазы - высота дерева, время вставки и удаления
+// на точку и время запроса в сравнении с деревом, построенным заново.
+void benchmarkDynamic(std::size_t num_points,
+                      std::size_t num_phases,
+                      std::size_t num_queries,
+                      std::size_t num_neighbors)
+{
+    auto points = makePoints(num_points, 1'000'000, 4);
+    std::sort(points.begin(), points.end(),
+              [](const Point2D& lhs, const Point2D& rhs){ return lhs.compareLess(rhs, 0); });
+
+    const auto queries = makePoints(num_queries, 1'000'000, 5);
+    const std::size_t phase_size = num_points / num_phases;
+
+    KdTree<Point2D> tree;
+    for (std::size_t phase = 0; phase < num_phases; ++phase)
+    {
+        const auto first = points.begin() + phase * phase_size;
+        const double insert_time = measure([&](){
+            for (auto it = first; it != first + phase_size; ++it)
+                tree.insert(Point2D{*it}); });
+
+        // Со второй фазы окно скользящее: удаляется столько же, сколько вставлено
+        double remove_time = 0.0;
+        if (phase > 0)
+            remove_time = measure([&](){
+                for (auto it = first - phase_size; it != first; ++it)
+                    tree.remove(*it); });
+
+        const double query_time = measure([&](){
+            for (const auto& query : queries)
+                tree.neighborsSearch(query, num_neighbors, false); });
+
+        const KdTree<Point2D> rebuilt{std::vector<Point2D>(phase > 0 ? first - phase_size : first,
+                                                           first + phase_size)};
+        const double rebuilt_time = measure([&](){
+            for (const auto& query : queries)
+                rebuilt.neighborsSearch(query, num_neighbors, false); });
+
+        std::cout << std::setw(12) << phase
+                  << std::setw(12) << tree.getSize()
+                  << std::setw(8) << tree.getHeight()
+                  << std::setw(8) << rebuilt.getHeight()
+                  << std::setw(12) << insert_time * 1.0E6 / phase_size
+                  << std::setw(12) << remove_time * 1.0E6 / phase_size
+                  << std::setw(12) << query_time * 1.0E6 / num_queries
+                  << std::setw(12) << rebuilt_time * 1.0E6 / num_queries
+                  << '\n';
+    }
+}
+
+// Пакетные вставка и удаление в сравнении с циклом одиночных операций
+// для пакетов разного размера относительно уже построенного дерева
+void benchmarkBatchUpdate(std::size_t num_points,
+                          std::size_t batch_size)
+{
+    const auto points = makePoints(num_points, 1'000'000, 6);
+    const auto batch = makePoints(batch_size, 1'000'000, 7);
+
+    KdTree<Point2D> single_tree{std::vector<Point2D>{points}};
+    const double single_insert_time = measure([&](){
+        for (const auto& point : batch)
+            single_tree.insert(Point2D{point}); });
+
+    const double single_remove_time = measure([&](){
+        for (const auto& point : batch)
+            single_tree.remove(point); });
+
+    KdTree<Point2D> batch_tree{std::vector<Point2D>{points}};
+    const double batch_insert_time = measure([&](){
+        batch_tree.insert(std::vector<Point2D>{batch}); });
+
+    const double batch_remove_time = measure([&](){
+        batch_tree.remove(batch); });
+
+    std::cout << std::setw(12) << num_points
+              << std::setw(12) << batch_size
+              << std::setw(12) << single_insert_time * 1.0E3
+              << std::setw(12) << batch_insert_time * 1.0E3
+              << std::setw(12) << single_remove_time * 1.0E3
+              << std::setw(12) << batch_remove_time * 1.0E3
+              << (single_tree.getSize() == batch_tree.getSize() ? "" : "  (!)")
+              << '\n';
+}
+
+// Удаление с пометкой узлов: время удаления и запроса по мере роста доли
+// удалённых узлов без уплотнения, а затем время уплотнения и запроса после
+void benchmarkTombstones(std::size_t num_points,
+                         std::size_t num_queries,
+                         std::size_t num_neighbors)
+{
+    auto points = makePoints(num_points, 1'000'000, 8);
+    const auto queries = makePoints(num_queries, 1'000'000, 9);
+
+    KdTree<Point2D> tree{std::vector<Point2D>{points}};
+    tree.setCompactionThreshold(1.0);
+
+    auto printRow = [&](const std::string& name, double remove_time, std::size_t num_removed){
+        const double query_time = measure([&](){
+            for (const auto& query : queries)
+                tree.neighborsSearch(query, num_neighbors, false); });
+
+        std::cout << std::left << std::setw(12) << name << std::right
+                  << std::setw(12) << tree.getSize()
+                  << std::setw(8) << num_neighbors
+                  << std::setw(12) << (num_removed ? remove_time * 1.0E6 / num_removed : 0.0)
+                  << std::setw(12) << query_time * 1.0E6 / num_queries
+                  << '\n';
+    };
+
+    printRow("0%", 0.0, 0);
+
+    std::size_t num_removed = 0;
+    for (std::size_t percent : {10UL, 20UL, 40UL})
+    {
+        const std::size_t last = num_points * percent / 100;
+        const double remove_time = measure([&](){
+            for (std::size_t i = num_removed; i < last; ++i)
+                tree.remove(points[i]); });
+
+        printRow(std::to_string(percent) + "%", remove_time, last - num_removed);
+        num_removed = last;
+    }
+
+    const double compact_time = measure([&](){ tree.compact(); });
+    std::cout << std::left << std::setw(12) << "compact, ms" << std::right
+              << std::setw(12) << compact_time * 1.0E3
+              << '\n';
+
+    printRow("compacted", 0.0, 0);
+}
+
+// Стоимость снимка и рост памяти при изменении дерева, пока снимок жив,
+// в сравнении с теми же изменениями без снимка. Каждые batch_size вставок
+// делается новый снимок, как если бы читателям отдавалась новая версия.
+void benchmarkSnapshots(std::size_t num_points,
+                        std::size_t num_updates,
+                        std::size_t batch_size)
+{
+    const auto points = makePoints(num_points, 1'000'000, 10);
+    const auto updates = makePoints(num_updates, 1'000'000, 11);
+
+    for (bool snapshots : {false, true})
+    {
+        std::size_t base_bytes = allocated_bytes;
+        KdTree<Point2D> tree{std::vector<Point2D>{points}};
+        const std::size_t tree_bytes = allocated_bytes - base_bytes;
+
+        std::vector<KdTree<Point2D>> versions;
+        double snapshot_time = 0.0;
+        base_bytes = allocated_bytes;
+        const double update_time = measure([&](){
+            for (std::size_t i = 0; i < num_updates; ++i)
+            {
+                if (snapshots && i % batch_size == 0)
+                    snapshot_time += measure([&](){ versions.push_back(tree); });
+
+                tree.insert(Point2D{updates[i]});
+            } });
+
+        const double update_bytes = static_cast<double>(allocated_bytes - base_bytes)
+                                  / num_updates;
+
+        std::cout << std::left << std::setw(12) << (snapshots ? "snapshots" : "none") << std::right
+                  << std::setw(12) << num_points
+                  << std::setw(12) << batch_size
+                  << std::setw(12) << tree_bytes / num_points
+                  << std::setw(12) << (snapshots ? snapshot_time * 1.0E9 / versions.size() : 0.0)
+                  << std::setw(12) << update_time * 1.0E6 / num_updates
+                  << std::setw(12) << update_bytes
+                  << '\n';
+    }
+}
+
+// Холодный старт: от файла на диске до ответа на первые запросы. Опорные
+// точки либо читаются из JSON и дерево строится заново, либо готовое дерево
+// отображается в память из файла, сохранённого FlatKdTree::save(). Оба
+// файла только что записаны, поэтому они в страничном кэше системы.
+void benchmarkColdStart(std::size_t num_points,
+                        std::size_t num_queries,
+                        std::size_t num_neighbors)
+{
+    using Tree = FlatKdTree<Point2D>;
+
+    constexpr std::array axis_names{"x", "y"};
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto json_fn = (directory / "proximal_cold_start.json").string();
+    const auto tree_fn = (directory / "proximal_cold_start.bin").string();
+
+    const auto queries = makePoints(num_queries, 1'000'000, 12);
+    {
+        auto points = makePoints(num_points, 1'000'000, 12);
+        writePoints(json_fn, points, -1, axis_names, "value");
+        Tree{std::move(points), Tree::INDEX_LEAF_SIZE}.save(tree_fn);
+    }
+
+    for (bool mapped : {false, true})
+    {
+        Tree tree;
+        const double open_time = measure([&](){
+            if (mapped)
+                tree = Tree::open(tree_fn);
+            else
+                tree = Tree{readPoints<Point2D>(json_fn, axis_names, "value"), Tree::INDEX_LEAF_SIZE}; });
+
+        const double query_time = measure([&](){
+            for (const auto& query : queries)
+                tree.neighborsSearch(query, num_neighbors, false); });
+
+        const auto file_size = std::filesystem::file_size(mapped ? tree_fn : json_fn);
+
+        std::cout << std::left << std::setw(12) << (mapped ? "mmap" : "json+build") << std::right
+                  << std::setw(12) << tree.getSize()
+                  << std::setw(12) << file_size / 1.0E6
+                  << std::setw(12) << open_time * 1.0E3
+                  << std::setw(12) << query_time * 1.0E6 / num_queries
+                  << std::setw(12) << (open_time + query_time) * 1.0E3
+                  << '\n';
+    }
+
+    std::filesystem::remove(json_fn);
+    std::filesystem::remove(tree_fn);
+}
+
+// Чтение опорных точек из JSON и из двоичного файла по столбцам:
+// время, размер файла и пиковый расход памяти относительно результата
+void benchmarkPointsFormat(std::size_t num_points)
+{
+    constexpr std::array axis_names{"x", "y"};
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto json_fn = (directory / "proximal_points_format.json").string();
+    const auto binary_fn = (directory / "proximal_points_format.bin").string();
+
+    {
+        const auto points = makePoints(num_points, 1'000'000, 13);
+        writePoints(json_fn, points, -1, axis_names, "value");
+        writeBinaryPoints(binary_fn, points);
+    }
+
+    for (bool binary : {false, true})
+    {
+        const auto& filename = binary ? binary_fn : json_fn;
+
+        const std::size_t base_bytes = allocated_bytes;
+        peak_bytes = base_bytes;
+
+        std::vector<Point2D> points;
+        const double read_time = measure([&](){
+            points = readPoints<Point2D>(filename, axis_names, "value"); });
+
+        const std::size_t output_bytes = points.size() * sizeof(Point2D);
+        std::cout << std::left << std::setw(12) << (binary ? "binary" : "json") << std::right
+                  << std::setw(12) << points.size()
+                  << std::setw(12) << std::filesystem::file_size(filename) / 1.0E6
+                  << std::setw(12) << read_time * 1.0E3
+                  << std::setw(16) << static_cast<double>(peak_bytes - base_bytes) / output_bytes
+                  << '\n';
+    }
+
+    std::filesystem::remove(json_fn);
+    std::filesystem::remove(binary_fn);
+}
+
+// Удаление повторов при чтении: в узком диапазоне координат
+// примерно четверть точек совпадает с предыдущими
+void benchmarkDuplicates(std::size_t num_points,
+                         int range)
+{
+    constexpr std::array axis_names{"x", "y"};
+    const auto filename = (std::filesystem::temp_directory_path()
+                           / "proximal_duplicates.bin").string();
+
+    auto points = makePoints(num_points, range, 19);
+    writeBinaryPoints(filename, points);
+
+    const double dedup_time = measure([&](){ removeDuplicatePoints(points); });
+
+    std::vector<Point2D> read_points;
+    const double read_time = measure([&](){
+        read_points = readPoints<Point2D>(filename, axis_names, "value"); });
+
+    std::cout << std::right << std::setw(12) << num_points
+              << std::setw(12) << range
+              << std::setw(12) << read_points.size()
+              << std::setw(12) << dedup_time * 1.0E3
+              << std::setw(12) << read_time * 1.0E3
+              << '\n';
+
+    std::filesystem::remove(filename);
+}
+
+void benchmarkResultWriter(std::size_t num_points)
+{
+    constexpr std::array axis_names{"x", "y"};
+    const auto filename = (std::filesystem::temp_directory_path()
+                           / "proximal_result_writer.json").string();
+
+    const auto points = makePoints(num_points, 1'000'000, 17);
+    const std::size_t output_bytes = points.size() * sizeof(Point2D);
+
+    for (bool streaming : {false, true})
+    {
+        const std::size_t base_bytes = allocated_bytes;
+        peak_bytes = base_bytes;
+
+        const double write_time = measure([&](){
+            if (streaming)
+            {
+                JsonPointsWriter<int, double, 2> writer{filename, 4, axis_names, "value"};
+                for (auto& point : points)
+                    writer.write(point);
+                writer.close();
+            }
+            else
+                writePoints(filename, points, 4, axis_names, "value");
+        });
+
+        std::cout << std::left << std::setw(12) << (streaming ? "stream" : "dom") << std::right
+                  << std::setw(12) << points.size()
+                  << std::setw(12) << std::filesystem::file_size(filename) / 1.0E6
+                  << std::setw(12) << write_time * 1.0E3
+                  << std::setw(16) << static_cast<double>(peak_bytes - base_bytes) / output_bytes
+                  << '\n';
+    }
+
+    std::filesystem::remove(filename);
+}
+
+void printHeader(const char* title)
+{
+    std::cout << "\x1b[1;44m" << title << ":\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(12) << "points"
+              << std::setw(8) << "k"
+              << std::setw(12) << "B/point"
+              << std::setw(12) << "build, ms"
+              << std::setw(12) << "nns, us"
+              << std::setw(12) << "idw, us"
+              << '\n';
+}
+
+}
+
+int main()
+{
+    std::cout << std::fixed << std::setprecision(2);
+
+    printHeader("Layout");
+    benchmarkLayout(100'000, 10'000, 10);
+    benchmarkLayout(100'000, 10'000, 100);
+    benchmarkLayout(1'000'000, 10'000, 10);
+    benchmarkLayout(1'000'000, 1'000, 1000);
+
+    std::cout << "\x1b[1;44mBuild:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "build, ms"
+              << std::setw(16) << "peak/input"
+              << '\n';
+    for (std::size_t num_points : {1'000'000UL, 4'000'000UL})
+    {
+        benchmarkBuild<KdTree<Point2D>>("KdTree", num_points);
+        benchmarkBuild<FlatKdTree<Point2D>>("FlatKdTree", num_points);
+    }
+
+    // Масштабирование построения по числу потоков
+    for (std::size_t num_threads = 1;
+         num_threads <= std::max(std::thread::hardware_concurrency(), 1U);
+         num_threads *= 2)
+    {
+        const auto suffix = "/" + std::to_string(num_threads) + "t";
+        benchmarkBuild<KdTree<Point2D>>("KdTree" + suffix, 4'000'000, num_threads);
+        benchmarkBuild<FlatKdTree<Point2D>>("Flat" + suffix, 4'000'000, 1UL, num_threads);
+    }
+
+    printHeader("Leaf size");
+    benchmarkLeafSize(1'000'000, 10'000, 10);
+    benchmarkLeafSize(1'000'000, 1'000, 1000);
+
+    // Дерево целиком в кэше: задержка определяется вычислениями,
+    // в том числе сравнениями расстояний при поиске
+    printHeader("Cache-resident");
+    benchmarkLayout(10'000, 100'000, 10);
+    benchmarkLayout(10'000, 100'000, 100);
+
+    std::cout << "\x1b[1;44mIDW power:\x1b[0m\n"
+              << std::right << std::setw(12) << "power"
+              << std::setw(8) << "k"
+              << std::setw(16) << "ns/neighbor"
+              << '\n';
+    benchmarkIdwPower(1'000'000, 1'000, 1000);
+
+    std::cout << "\x1b[1;44mQuery form:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(8) << "k"
+              << std::setw(12) << "vector, us"
+              << std::setw(12) << "visitor, us"
+              << std::setw(12) << "shepard, us"
+              << std::setw(12) << "value, us"
+              << '\n';
+    benchmarkQueryForms(1'000'000, 100'000, 10);
+    benchmarkQueryForms(1'000'000, 100'000, 100);
+
+    std::cout << "\x1b[1;44mQuery workspace:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(8) << "k"
+              << std::setw(12) << "temp, us"
+              << std::setw(12) << "allocs"
+              << std::setw(12) << "reused, us"
+              << std::setw(12) << "allocs"
+              << '\n';
+    benchmarkWorkspaces(1'000'000, 100'000, 10);
+    benchmarkWorkspaces(1'000'000, 100'000, 100);
+    benchmarkWorkspaces(1'000'000, 10'000, 1000);
+
+    benchmarkBatch(1'000'000, 100'000, 100);
+
+    std::cout << "\x1b[1;44mQuery order:\x1b[0m\n"
+              << std::left << std::setw(12) << "order" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "queries"
+              << std::setw(8) << "k"
+              << std::setw(12) << "query, us"
+              << '\n';
+    benchmarkMorton(1'000'000, 100'000, 10);
+    benchmarkMorton(4'000'000, 100'000, 10);
+    benchmarkMorton(4'000'000, 100'000, 100);
+
+    std::cout << "\x1b[1;44mApproximate:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(12) << "points"
+              << std::setw(8) << "k"
+              << std::setw(12) << "epsilon"
+              << std::setw(12) << "idw, us"
+              << std::setw(12) << "speedup"
+              << std::setw(12) << "mean err"
+              << std::setw(12) << "max err"
+              << '\n';
+    for (std::size_t num_neighbors : {100UL, 1000UL})
+    {
+        benchmarkApprox<KdTree<Point2D>>("KdTree", 1'000'000, 2'000, num_neighbors);
+        benchmarkApprox<FlatKdTree<Point2D>>("Flat/16", 1'000'000, 2'000, num_neighbors, 16UL);
+    }
+
+    std::cout << "\x1b[1;44mBudget:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::setw(12) << "search" << std::right
+              << std::setw(8) << "k"
+              << std::setw(12) << "p50, us"
+              << std::setw(12) << "p99, us"
+              << std::setw(12) << "max, us"
+              << std::setw(12) << "exact, %"
+              << std::setw(12) << "recall, %"
+              << '\n';
+    benchmarkBudget<KdTree<Point2D>>("KdTree", 1'000'000, 10'000, 10);
+    benchmarkBudget<FlatKdTree<Point2D>>("Flat/16", 1'000'000, 10'000, 10, 16UL);
+
+    std::cout << "\x1b[1;44mRadius:\x1b[0m\n"
+              << std::left << std::setw(12) << "tree" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "radius"
+              << std::setw(12) << "found"
+              << std::setw(12) << "search, us"
+              << std::setw(12) << "count, us"
+              << std::setw(12) << "k-nn, us"
+              << '\n';
+    for (double radius : {2'000.0, 10'000.0, 30'000.0})
+    {
+        benchmarkRadius<KdTree<Point2D>>("KdTree", 1'000'000, 10'000, radius);
+        benchmarkRadius<FlatKdTree<Point2D>>("Flat/16", 1'000'000, 10'000, radius, 16UL);
+    }
+
+    std::cout << "\x1b[1;44mDynamic:\x1b[0m\n"
+              << std::setw(12) << "phase"
+              << std::setw(12) << "points"
+              << std::setw(8) << "height"
+              << std::setw(8) << "static"
+              << std::setw(12) << "insert, us"
+              << std::setw(12) << "remove, us"
+              << std::setw(12) << "nns, us"
+              << std::setw(12) << "static, us"
+              << '\n';
+    benchmarkDynamic(1'000'000, 10, 10'000, 10);
+
+    std::cout << "\x1b[1;44mBatch update:\x1b[0m\n"
+              << std::setw(12) << "points"
+              << std::setw(12) << "batch"
+              << std::setw(12) << "insert, ms"
+              << std::setw(12) << "batch, ms"
+              << std::setw(12) << "remove, ms"
+              << std::setw(12) << "batch, ms"
+              << '\n';
+    for (std::size_t batch_size : {10'000UL, 100'000UL, 1'000'000UL})
+        benchmarkBatchUpdate(1'000'000, batch_size);
+
+    std::cout << "\x1b[1;44mTombstones:\x1b[0m\n"
+              << std::left << std::setw(12) << "deleted" << std::right
+              << std::setw(12) << "points"
+              << std::setw(8) << "k"
+              << std::setw(12) << "remove, us"
+              << std::setw(12) << "nns, us"
+              << '\n';
+    benchmarkTombstones(1'000'000, 10'000, 10);
+
+    std::cout << "\x1b[1;44mSnapshots:\x1b[0m\n"
+              << std::left << std::setw(12) << "versions" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "interval"
+              << std::setw(12) << "B/point"
+              << std::setw(12) << "copy, ns"
+              << std::setw(12) << "insert, us"
+              << std::setw(12) << "B/insert"
+              << '\n';
+    for (std::size_t batch_size : {1UL, 100UL})
+        benchmarkSnapshots(1'000'000, 10'000, batch_size);
+
+    std::cout << "\x1b[1;44mCold start:\x1b[0m\n"
+              << std::left << std::setw(12) << "source" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "file, MB"
+              << std::setw(12) << "open, ms"
+              << std::setw(12) << "nns, us"
+              << std::setw(12) << "total, ms"
+              << '\n';
+    for (std::size_t num_points : {100'000UL, 1'000'000UL})
+        benchmarkColdStart(num_points, 1'000, 10);
+
+    std::cout << "\x1b[1;44mPoints format:\x1b[0m\n"
+              << std::left << std::setw(12) << "format" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "file, MB"
+              << std::setw(12) << "read, ms"
+              << std::setw(16) << "peak/output"
+              << '\n';
+    for (std::size_t num_points : {100'000UL, 1'000'000UL})
+        benchmarkPointsFormat(num_points);
+
+    std::cout << "\x1b[1;44mDuplicates:\x1b[0m\n"
+              << std::right << std::setw(12) << "points"
+              << std::setw(12) << "range"
+              << std::setw(12) << "unique"
+              << std::setw(12) << "dedup, ms"
+              << std::setw(12) << "read, ms"
+              << '\n';
+    for (int range : {1'000'000, 2'000})
+        benchmarkDuplicates(10'000'000, range);
+
+    std::cout << "\x1b[1;44mResult writer:\x1b[0m\n"
+              << std::left << std::setw(12) << "writer" << std::right
+              << std::setw(12) << "points"
+              << std::setw(12) << "file, MB"
+              << std::setw(12) << "write, ms"
+              << std::setw(16) << "peak/output"
+              << '\n';
+    for (std::size_t num_points : {100'000UL, 1'000'000UL})
+        benchmarkResultWriter(num_points);
+
+    return 0;
+}
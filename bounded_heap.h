@@ -0,0 +1,209 @@
+﻿#pragma once
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+// Двоичная куча ограниченной ёмкости для отбора k наименьших элементов: на
+// вершине всегда наибольший из них (для поиска соседей - самый дальний),
+// который заменяется новым элементом без извлечения и повторной вставки.
+//
+// Ёмкость задаётся во время выполнения. Если она не больше InlineCapacity,
+// то элементы хранятся в самом объекте (т.е. на стеке, если он создан на
+// стеке), иначе - в векторе, который при повторном использовании кучи с
+// той же или меньшей ёмкостью не перераспределяется.
+template<class T, std::size_t InlineCapacity = 32, class Compare = std::less<T>>
+class BoundedHeap final
+{
+    static_assert(std::is_trivially_destructible_v<T>);
+
+public:
+    BoundedHeap() = default;
+
+    explicit BoundedHeap(std::size_t capacity);
+
+    // Очищает кучу и задаёт новую ёмкость
+    void reset(std::size_t capacity);
+
+    std::size_t size() const noexcept;
+
+    std::size_t capacity() const noexcept;
+
+    bool empty() const noexcept;
+
+    bool isFull() const noexcept;
+
+    const T& top() const noexcept;
+
+    // Только пока куча не заполнена
+    void push(const T& value) noexcept;
+
+    // Только если куча не пуста
+    void replaceTop(const T& value) noexcept;
+
+    // Добавляет элемент, если есть место или если он меньше вершины
+    bool update(const T& value) noexcept;
+
+    // Упорядочивает элементы по возрастанию за O(k log k) на месте, после
+    // чего кучей пользоваться нельзя до вызова reset(), но можно обходить
+    // элементы по порядку с помощью begin() и end().
+    void sort() noexcept;
+
+    const T* begin() const noexcept;
+
+    const T* end() const noexcept;
+
+private:
+    T* data() noexcept;
+
+    const T* data() const noexcept;
+
+    std::array<T, InlineCapacity> inline_storage_;
+    std::vector<T> storage_;
+    std::size_t size_{0};
+    std::size_t capacity_{0};
+    [[no_unique_address]] Compare compare_;
+};
+
+
+template<class T, std::size_t InlineCapacity, class Compare>
+BoundedHeap<T, InlineCapacity, Compare>::BoundedHeap(std::size_t capacity)
+{
+    reset(capacity);
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+void BoundedHeap<T, InlineCapacity, Compare>::reset(std::size_t capacity)
+{
+    if (capacity > InlineCapacity && capacity > storage_.size())
+        storage_.resize(capacity);
+
+    size_ = 0;
+    capacity_ = capacity;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+std::size_t BoundedHeap<T, InlineCapacity, Compare>::size() const noexcept
+{
+    return size_;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+std::size_t BoundedHeap<T, InlineCapacity, Compare>::capacity() const noexcept
+{
+    return capacity_;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+bool BoundedHeap<T, InlineCapacity, Compare>::empty() const noexcept
+{
+    return size_ == 0;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+bool BoundedHeap<T, InlineCapacity, Compare>::isFull() const noexcept
+{
+    return size_ == capacity_;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+const T& BoundedHeap<T, InlineCapacity, Compare>::top() const noexcept
+{
+    return data()[0];
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+void BoundedHeap<T, InlineCapacity, Compare>::push(const T& value) noexcept
+{
+    T* heap = data();
+
+    // Просеивание вверх "дыркой": родители сдвигаются вниз,
+    // а новый элемент записывается один раз в конце.
+    std::size_t i = size_++;
+    while (i > 0)
+    {
+        const std::size_t parent = (i - 1) / 2;
+        if (!compare_(heap[parent], value))
+            break;
+
+        heap[i] = heap[parent];
+        i = parent;
+    }
+
+    heap[i] = value;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+void BoundedHeap<T, InlineCapacity, Compare>::replaceTop(const T& value) noexcept
+{
+    T* heap = data();
+
+    // Просеивание вниз тоже "дыркой" от вершины
+    std::size_t i = 0;
+    for (std::size_t child = 1; child < size_; child = 2 * i + 1)
+    {
+        if (child + 1 < size_)
+            child += compare_(heap[child], heap[child + 1]);
+
+        if (!compare_(value, heap[child]))
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = value;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+bool BoundedHeap<T, InlineCapacity, Compare>::update(const T& value) noexcept
+{
+    if (size_ < capacity_)
+    {
+        push(value);
+
+        return true;
+    }
+
+    if (size_ != 0 && compare_(value, top()))
+    {
+        replaceTop(value);
+
+        return true;
+    }
+
+    return false;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+void BoundedHeap<T, InlineCapacity, Compare>::sort() noexcept
+{
+    std::sort_heap(data(), data() + size_, compare_);
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+const T* BoundedHeap<T, InlineCapacity, Compare>::begin() const noexcept
+{
+    return data();
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+const T* BoundedHeap<T, InlineCapacity, Compare>::end() const noexcept
+{
+    return data() + size_;
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+T* BoundedHeap<T, InlineCapacity, Compare>::data() noexcept
+{
+    return capacity_ > InlineCapacity ? storage_.data() : inline_storage_.data();
+}
+
+template<class T, std::size_t InlineCapacity, class Compare>
+const T* BoundedHeap<T, InlineCapacity, Compare>::data() const noexcept
+{
+    return capacity_ > InlineCapacity ? storage_.data() : inline_storage_.data();
+}
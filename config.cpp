@@ -21,8 +21,13 @@ ConfigParams::ConfigParams() noexcept(isNoThrowConstructible<decltype(params_)>(
         {STRINGIFY(unknown_points_fn), unknown_points_fn},
         {STRINGIFY(num_neighbors), num_neighbors},
         {STRINGIFY(reverse_search), reverse_search},
+        {STRINGIFY(approx_epsilon), approx_epsilon},
         {STRINGIFY(idw_power), idw_power},
-        {STRINGIFY(json_indent), json_indent}}
+        {STRINGIFY(search_radius), search_radius},
+        {STRINGIFY(json_indent), json_indent},
+        {STRINGIFY(num_threads), num_threads},
+        {STRINGIFY(morton_order), morton_order},
+        {STRINGIFY(tree_index_fn), tree_index_fn}}
 {
 }
 
@@ -107,13 +112,39 @@ bool ConfigParams::readConfig(std::ifstream& file)
     if (iterator != data.cend() && iterator->is_boolean())
         iterator.value().get_to(reverse_search);
 
+    // Ноль - точный поиск
+    iterator = data.find(STRINGIFY(approx_epsilon));
+    if (iterator != data.cend() && iterator->is_number())
+        if (auto number = iterator.value().template get<decltype(approx_epsilon)>(); number >= 0.0)
+            approx_epsilon = number;
+
     iterator = data.find(STRINGIFY(idw_power));
     if (iterator != data.cend() && iterator->is_number_float())
         iterator.value().get_to(idw_power);
 
+    // Ноль - поиск в радиусе выключен
+    iterator = data.find(STRINGIFY(search_radius));
+    if (iterator != data.cend() && iterator->is_number())
+        if (auto number = iterator.value().template get<decltype(search_radius)>(); number >= 0.0)
+            search_radius = number;
+
     iterator = data.find(STRINGIFY(json_indent));
     if (iterator != data.cend() && iterator->is_number_integer())
         iterator.value().get_to(json_indent);
 
+    // Ноль здесь допустим - это число аппаратных потоков
+    iterator = data.find(STRINGIFY(num_threads));
+    if (iterator != data.cend() && iterator->is_number_unsigned())
+        iterator.value().get_to(num_threads);
+
+    iterator = data.find(STRINGIFY(morton_order));
+    if (iterator != data.cend() && iterator->is_boolean())
+        iterator.value().get_to(morton_order);
+
+    // Пустая строка - файл дерева не используется
+    iterator = data.find(STRINGIFY(tree_index_fn));
+    if (iterator != data.cend() && iterator->is_string())
+        iterator.value().get_to(tree_index_fn);
+
     return true;
 }
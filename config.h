@@ -27,8 +27,13 @@ class ConfigParams final
     std::string unknown_points_fn{"unknown_points.json"};
     std::size_t num_neighbors{100UL};
     bool reverse_search{false};
+    double approx_epsilon{0.0};
     double idw_power{2.0};
+    double search_radius{0.0};
     int json_indent{4};
+    std::size_t num_threads{0UL};
+    bool morton_order{false};
+    std::string tree_index_fn{""};
 
     std::tuple<std::pair<const char*, decltype(config_fn)&>,
                std::pair<const char*, decltype(output_fn)&>,
@@ -36,8 +41,13 @@ class ConfigParams final
                std::pair<const char*, decltype(unknown_points_fn)&>,
                std::pair<const char*, decltype(num_neighbors)&>,
                std::pair<const char*, decltype(reverse_search)&>,
+               std::pair<const char*, decltype(approx_epsilon)&>,
                std::pair<const char*, decltype(idw_power)&>,
-               std::pair<const char*, decltype(json_indent)&>>
+               std::pair<const char*, decltype(search_radius)&>,
+               std::pair<const char*, decltype(json_indent)&>,
+               std::pair<const char*, decltype(num_threads)&>,
+               std::pair<const char*, decltype(morton_order)&>,
+               std::pair<const char*, decltype(tree_index_fn)&>>
     params_;
 
     ConfigParams() noexcept(isNoThrowConstructible<decltype(params_)>());
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <array>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// Квадраты расстояний от точки target до count точек, координаты которых
+// хранятся по осям в отдельных массивах (structure of arrays). Вычисления
+// выполняются в double: для целых координат по модулю меньше 2^26 это
+// точно, а для остальных погрешность не больше, чем у Point::getDistance().
+// Результат нужен только для отсева точек, поэтому этого достаточно.
+template<class C, std::size_t N>
+void getSquaredDistances(const std::array<const C*, N>& coords,
+                         const std::array<double, N>& target,
+                         std::size_t count,
+                         double* distances) noexcept
+{
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    if constexpr (std::is_same_v<C, int> || std::is_same_v<C, double>)
+    {
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256d sum = _mm256_setzero_pd();
+            for (std::size_t axis = 0; axis < N; ++axis)
+            {
+                __m256d coord;
+                if constexpr (std::is_same_v<C, int>)
+                    coord = _mm256_cvtepi32_pd(
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(coords[axis] + i)));
+                else
+                    coord = _mm256_loadu_pd(coords[axis] + i);
+
+                const __m256d diff = _mm256_sub_pd(coord, _mm256_set1_pd(target[axis]));
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(diff, diff));
+            }
+
+            _mm256_storeu_pd(distances + i, sum);
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    if constexpr (std::is_same_v<C, int> || std::is_same_v<C, double>)
+    {
+        for (; i + 2 <= count; i += 2)
+        {
+            __m128d sum = _mm_setzero_pd();
+            for (std::size_t axis = 0; axis < N; ++axis)
+            {
+                __m128d coord;
+                if constexpr (std::is_same_v<C, int>)
+                    coord = _mm_cvtepi32_pd(
+                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(coords[axis] + i)));
+                else
+                    coord = _mm_loadu_pd(coords[axis] + i);
+
+                const __m128d diff = _mm_sub_pd(coord, _mm_set1_pd(target[axis]));
+                sum = _mm_add_pd(sum, _mm_mul_pd(diff, diff));
+            }
+
+            _mm_storeu_pd(distances + i, sum);
+        }
+    }
+#endif
+
+    // Остаток, а также все остальные типы координат
+    for (; i < count; ++i)
+    {
+        double sum = 0.0;
+        for (std::size_t axis = 0; axis < N; ++axis)
+        {
+            const double diff = static_cast<double>(coords[axis][i]) - target[axis];
+            sum += diff * diff;
+        }
+
+        distances[i] = sum;
+    }
+}
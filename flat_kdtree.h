@@ -0,0 +1,1229 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include <span>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <future>
+#include <utility>
+#include <functional>
+#include <concepts>
+#include <type_traits>
+
+#include <algorithm>
+
+#include <ostream>
+#include <fstream>
+#include <iostream>
+
+#include <exception>
+
+#include "utils.h"
+#include "bounded_heap.h"
+#include "distance_kernels.h"
+#include "idw_kernels.h"
+#include "mapped_file.h"
+
+template<class>
+class FlatKdTree;
+
+template<class Item>
+std::ostream& operator<<(std::ostream&, const FlatKdTree<Item>&);
+
+// Неизменяемое k-мерное дерево без указателей. Все элементы хранятся в одном
+// непрерывном массиве, упорядоченном так, что любое поддерево - это отрезок
+// [first, last) этого массива, а его корень - элемент с индексом median
+// (середина отрезка), т.е. медиана по оси, номер которой определяется
+// глубиной узла так же, как и в KdTree. Левое поддерево занимает отрезок
+// [first, median), а правое - [median + 1, last). Таким образом дочерние
+// узлы и ось разбиения задаются неявно и не занимают памяти вообще, а на
+// каждую точку приходится ровно sizeof(Item) байт.
+//
+// Поддеревья размером не больше leaf_size не разбиваются дальше, а
+// становятся листьями-корзинами. Координаты точек дублируются по осям
+// в отдельных массивах (structure of arrays), поэтому корзина - это
+// отрезок каждого из них, который просматривается векторизованно и в
+// кучу ближайших соседей попадают только прошедшие отбор точки.
+//
+// Дерево читает точки и координаты только через отрезки items_ и coords_,
+// а память под ними принадлежит storage_: это либо построенные в
+// конструкторе массивы, либо файл, сохранённый save() и отображённый в
+// память open(). Во втором случае дерево готово к поиску сразу, без
+// разбора и перестроения, а копии дерева разделяют одни и те же данные.
+template<class Item>
+class FlatKdTree final
+{
+    friend
+    std::ostream& operator<< <>(std::ostream& out, const FlatKdTree& tree);
+
+    // Неявный узел (на самом деле поддерево)
+    struct Node
+    {
+        Node(std::size_t first,
+             std::size_t last,
+             std::size_t dimension) noexcept;
+
+        Node getLeft() const noexcept;
+
+        Node getRight() const noexcept;
+
+        bool isEmpty() const noexcept;
+
+        bool isLeaf(std::size_t leaf_size) const noexcept;
+
+        std::size_t first;
+        std::size_t median;
+        std::size_t last;
+        std::size_t dimension;
+    };
+
+    // Nearest Neighbors Search
+    // Session Properties
+    struct NnsSessProps
+    {
+        static_assert(std::is_trivially_destructible_v<Item>);
+
+        // Квадраты расстояний, как и в KdTree
+        using Pair = std::pair<decltype(std::declval<Item>().getSquaredDistance(std::declval<Item>())),
+                               const Item*>;
+
+        struct CompareLess
+        {
+            bool operator()(const Pair& lhs,
+                            const Pair& rhs) const noexcept
+            {
+                return lhs.first < rhs.first;
+            }
+        };
+
+        // Для небольшого числа соседей куча целиком на стеке
+        using Heap = BoundedHeap<Pair, 32, CompareLess>;
+
+        // Отложенная при обходе ветвь, как и в KdTree: медиана родителя,
+        // поддерево [first, last) и квадрат расстояния до плоскости
+        // разбиения. Поддерево хранится отрезком, чтобы стек был массивом
+        // на стеке потока без конструирования элементов.
+        struct Branch
+        {
+            const Item* median;
+            std::size_t first;
+            std::size_t last;
+            std::size_t dimension;
+            typename Pair::first_type distance;
+        };
+
+        // Каждый уровень дерева вдвое меньше предыдущего, поэтому
+        // внутренних узлов на пути от корня не больше числа битов size_t
+        static constexpr std::size_t MAX_DEPTH = std::numeric_limits<std::size_t>::digits;
+
+        using Stack = std::array<Branch, MAX_DEPTH>;
+
+        NnsSessProps(const Item& item,
+                     std::size_t num_neighbors,
+                     double approx_epsilon,
+                     Heap& heap);
+
+        NnsSessProps(const NnsSessProps&) = delete;
+        NnsSessProps& operator=(const NnsSessProps&) = delete;
+
+        void updateQueue(const Item* neighbor);
+
+        bool isAuxRequired(typename Pair::first_type distance) const;
+
+        const Item& item;
+        // Куча из рабочего пространства запроса, как и в KdTree
+        Heap& neighbors;
+        // (1 + ε)^2 для приближённого поиска, как и в KdTree
+        double prune_factor;
+        std::array<double, Item::getNumAxes()> coords;
+    };
+
+    using Coord = std::decay_t<decltype(std::declval<Item>().getCoord(0))>;
+
+    // Массивы, построенные конструктором
+    struct Buffers
+    {
+        std::vector<Item> items;
+        std::array<std::vector<Coord>, Item::getNumAxes()> coords;
+    };
+
+    // Заголовок файла дерева. За ним с выравниванием FILE_ALIGNMENT идут
+    // массив точек в порядке дерева и, если листья - корзины, массивы
+    // координат по осям. Все числа записаны в порядке байтов машины,
+    // сохранившей файл, который проверяется по byte_order при открытии.
+    struct FileHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint32_t item_size;
+        std::uint32_t coord_type;
+        std::uint32_t value_type;
+        std::uint32_t num_axes;
+        std::uint64_t leaf_size;
+        std::uint64_t num_items;
+    };
+
+    static constexpr char FILE_MAGIC[] = "PIKDTREE";
+    static constexpr std::uint32_t FILE_VERSION = 1U;
+
+public:
+    using Distance = decltype(std::declval<Item>().getDistance(std::declval<Item>()));
+
+    using SquaredDistance = decltype(std::declval<Item>().getSquaredDistance(std::declval<Item>()));
+
+    using Value = std::decay_t<decltype(std::declval<Item>().getValue())>;
+
+    // Рабочее пространство запросов поиска соседей (см. KdTree)
+    class QueryWorkspace final
+    {
+        friend class FlatKdTree;
+
+        typename NnsSessProps::Heap neighbors;
+    };
+
+    static constexpr std::size_t MAX_LEAF_SIZE = 64UL;
+
+    // Размер листьев дерева, которое программа строит для файла дерева, и
+    // деревьев тестов производительности: на нём поиск почти быстрее всего
+    // (см. benchmarkLeafSize()), а размер сохраняется в самом файле.
+    static constexpr std::size_t INDEX_LEAF_SIZE = 16UL;
+
+    // Поддеревья меньшего размера всегда строятся в одном потоке
+    static constexpr std::size_t PARALLEL_BUILD_CUTOFF = 1UL << 14;
+
+    FlatKdTree() = default;
+
+    // num_threads = 0 - по числу аппаратных потоков
+    FlatKdTree(std::vector<Item>&& items,
+               std::size_t leaf_size = 1,
+               std::size_t num_threads = 1) noexcept;
+
+    // Копия разделяет с оригиналом неизменяемые данные. Перемещение не
+    // объявлено, чтобы у перемещённого дерева не оставалось отрезков,
+    // ссылающихся на чужую память, и выполняется как копирование.
+    FlatKdTree(const FlatKdTree&) = default;
+    FlatKdTree& operator=(const FlatKdTree&) = default;
+
+    // Сохраняет дерево в двоичный файл для open()
+    bool save(const std::string& filename) const noexcept;
+
+    // Отображает в память файл, сохранённый save(). Если файла нет или он
+    // несовместим (другая версия, порядок байтов или тип точек), дерево пустое.
+    static FlatKdTree open(const std::string& filename) noexcept;
+
+    bool isEmpty() const noexcept;
+
+    std::size_t getSize() const noexcept;
+
+    std::size_t getLeafSize() const noexcept;
+
+    // approx_epsilon > 0 - приближённый поиск (см. NnsSessProps)
+    std::vector<Item> neighborsSearch(const Item& item,
+                                      std::size_t num_neighbors,
+                                      bool reverse_search,
+                                      double approx_epsilon = 0.0) const;
+
+    // Тот же поиск без вектора результата: visitor(квадрат расстояния,
+    // указатель на точку) вызывается для каждого соседа от ближнего к
+    // дальнему, а возвращается число соседей.
+    template<class Visitor>
+    requires std::invocable<Visitor&, SquaredDistance, const Item*>
+    std::size_t visitNeighbors(const Item& item,
+                               std::size_t num_neighbors,
+                               bool reverse_search,
+                               Visitor&& visitor,
+                               double approx_epsilon = 0.0) const;
+
+    template<class Visitor>
+    requires std::invocable<Visitor&, SquaredDistance, const Item*>
+    std::size_t visitNeighbors(QueryWorkspace& workspace,
+                               const Item& item,
+                               std::size_t num_neighbors,
+                               bool reverse_search,
+                               Visitor&& visitor,
+                               double approx_epsilon = 0.0) const;
+
+    std::vector<Item> shepardInterpolation(Item& item,
+                                           std::size_t num_neighbors,
+                                           bool reverse_search,
+                                           double idw_power,
+                                           double approx_epsilon = 0.0) const;
+
+    // Только значение в точке item, без копирования соседей (см. KdTree)
+    Value interpolate(const Item& item,
+                      std::size_t num_neighbors,
+                      bool reverse_search,
+                      double idw_power,
+                      double approx_epsilon = 0.0,
+                      std::vector<Item>* neighbors = nullptr) const;
+
+    Value interpolate(QueryWorkspace& workspace,
+                      const Item& item,
+                      std::size_t num_neighbors,
+                      bool reverse_search,
+                      double idw_power,
+                      double approx_epsilon = 0.0,
+                      std::vector<Item>* neighbors = nullptr) const;
+
+    // Поиск "сначала лучший" (best-bin-first): вместо обхода в глубину
+    // отложенные ветви хранятся в куче и просматриваются в порядке
+    // расстояния до их области, а max_checks ограничивает число вычислений
+    // расстояний до точек (0 - без ограничения). exact = false, если
+    // бюджет исчерпан раньше, чем доказано, что ближе соседей нет. Лист-
+    // корзина просматривается целиком, поэтому вычислений расстояний
+    // может быть на leaf_size - 1 больше, чем max_checks.
+    std::vector<Item> bestBinFirstSearch(const Item& item,
+                                         std::size_t num_neighbors,
+                                         std::size_t max_checks,
+                                         bool& exact) const;
+
+    // Все точки на расстоянии не больше radius от item в порядке обхода
+    // дерева. Буфер neighbors очищается, но его ёмкость сохраняется, так
+    // что при повторных запросах с тем же буфером память не выделяется.
+    std::size_t radiusSearch(const Item& item,
+                             Distance radius,
+                             std::vector<const Item*>& neighbors) const;
+
+    // Только количество таких точек, без их сохранения
+    std::size_t rangeCount(const Item& item,
+                           Distance radius) const;
+
+private:
+    static auto getComparator(std::size_t dimension) noexcept;
+
+    static constexpr std::size_t getItemsOffset() noexcept;
+
+    static std::size_t getCoordsOffset(std::size_t num_items,
+                                       std::size_t axis) noexcept;
+
+    Node getRoot() const noexcept;
+
+    void buildTree(std::vector<Item>& items,
+                   const Node& node,
+                   std::size_t num_threads) const;
+
+    static void fillCoords(Buffers& buffers);
+
+    void printTree(std::ostream& out,
+                   const Node& node,
+                   std::size_t depth) const;
+
+    void search(NnsSessProps& session,
+                bool reverse_search) const;
+
+    void forwardSearch(NnsSessProps& session) const;
+
+    void reverseSearch(NnsSessProps& session) const;
+
+    void scanLeaf(NnsSessProps& session,
+                  const Node& node) const;
+
+    bool bestBinFirstSearch(NnsSessProps& session,
+                            std::size_t max_checks) const;
+
+    template<class Visitor>
+    void rangeSearch(const Node& node,
+                     const Item& item,
+                     Distance radius,
+                     Visitor& visitor) const;
+
+    template<class Visitor>
+    void scanRange(const Node& node,
+                   const Item& item,
+                   Distance radius,
+                   Visitor& visitor) const;
+
+    std::shared_ptr<const void> storage_;
+    std::span<const Item> items_;
+    std::size_t leaf_size_{1};
+    std::array<std::span<const Coord>, Item::getNumAxes()> coords_;
+};
+
+
+template<class Item>
+FlatKdTree<Item>::FlatKdTree(std::vector<Item>&& items,
+                             std::size_t leaf_size,
+                             std::size_t num_threads) noexcept
+    : leaf_size_(std::clamp(leaf_size, std::size_t(1), MAX_LEAF_SIZE))
+{
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    try
+    {
+        auto buffers = std::make_shared<Buffers>();
+        buffers->items = std::move(items);
+
+        buildTree(buffers->items, Node{0, buffers->items.size(), 0}, num_threads);
+
+        if (leaf_size_ > 1)
+            fillCoords(*buffers);
+
+        items_ = buffers->items;
+        for (std::size_t axis = 0; axis < coords_.size(); ++axis)
+            coords_[axis] = buffers->coords[axis];
+
+        storage_ = std::move(buffers);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        storage_.reset();
+        items_ = {};
+        coords_ = {};
+    }
+}
+
+template<class Item>
+bool FlatKdTree<Item>::save(const std::string& filename) const noexcept
+{
+    static_assert(std::is_trivially_copyable_v<Item>);
+
+    if (items_.empty())
+        return false;
+
+    try
+    {
+        std::ofstream file{filename, std::ios::binary};
+        if (!file.is_open())
+            return false;
+
+        FileHeader header{};
+        std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+        header.version = FILE_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.item_size = sizeof(Item);
+        header.coord_type = getTypeTag<Coord>();
+        header.value_type = getTypeTag<Value>();
+        header.num_axes = Item::getNumAxes();
+        header.leaf_size = leaf_size_;
+        header.num_items = items_.size();
+
+        std::size_t offset = 0;
+        auto write = [&file, &offset](const void* data, std::size_t size){
+            file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            offset += size; };
+
+        const char padding[FILE_ALIGNMENT]{};
+        auto align = [&write, &offset, &padding](){
+            write(padding, alignFileOffset(offset) - offset); };
+
+        write(&header, sizeof(header));
+        align();
+        write(items_.data(), items_.size_bytes());
+
+        if (leaf_size_ > 1)
+            for (const auto& coords : coords_)
+            {
+                align();
+                write(coords.data(), coords.size_bytes());
+            }
+
+        file.close();
+
+        return !file.fail();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        return false;
+    }
+}
+
+template<class Item>
+FlatKdTree<Item> FlatKdTree<Item>::open(const std::string& filename) noexcept
+{
+    static_assert(std::is_trivially_copyable_v<Item>);
+
+    FlatKdTree tree;
+
+    try
+    {
+        auto file = std::make_shared<MappedFile>(filename);
+        if (!file->isOpen())
+            return tree;
+
+        const std::byte* data = file->getData();
+        const std::size_t size = file->getSize();
+
+        FileHeader header{};
+        if (size >= getItemsOffset())
+            std::memcpy(&header, data, sizeof(header));
+
+        if (std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != FILE_VERSION
+            || header.byte_order != BYTE_ORDER_MARK
+            || header.item_size != sizeof(Item)
+            || header.coord_type != getTypeTag<Coord>()
+            || header.value_type != getTypeTag<Value>()
+            || header.num_axes != Item::getNumAxes()
+            || header.leaf_size < 1 || header.leaf_size > MAX_LEAF_SIZE
+            || header.num_items < 1 || header.num_items > size / sizeof(Item))
+        {
+            std::cerr << "The tree file is incompatible!\n";
+
+            return tree;
+        }
+
+        const auto num_items = static_cast<std::size_t>(header.num_items);
+        const std::size_t end = header.leaf_size > 1 ? getCoordsOffset(num_items, Item::getNumAxes() - 1)
+                                                       + num_items * sizeof(Coord)
+                                                     : getItemsOffset() + num_items * sizeof(Item);
+        if (size < end)
+        {
+            std::cerr << "The tree file is truncated!\n";
+
+            return tree;
+        }
+
+        // Отображение выровнено по странице, а смещения - по FILE_ALIGNMENT,
+        // поэтому точки и координаты читаются прямо из отображённого файла.
+        tree.items_ = {reinterpret_cast<const Item*>(data + getItemsOffset()), num_items};
+        tree.leaf_size_ = static_cast<std::size_t>(header.leaf_size);
+        if (tree.leaf_size_ > 1)
+            for (std::size_t axis = 0; axis < tree.coords_.size(); ++axis)
+                tree.coords_[axis] = {reinterpret_cast<const Coord*>(data + getCoordsOffset(num_items, axis)),
+                                      num_items};
+
+        tree.storage_ = std::move(file);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        return FlatKdTree{};
+    }
+
+    return tree;
+}
+
+template<class Item>
+bool FlatKdTree<Item>::isEmpty() const noexcept
+{
+    return items_.empty();
+}
+
+template<class Item>
+std::size_t FlatKdTree<Item>::getSize() const noexcept
+{
+    return items_.size();
+}
+
+template<class Item>
+std::size_t FlatKdTree<Item>::getLeafSize() const noexcept
+{
+    return leaf_size_;
+}
+
+template<class Item>
+std::vector<Item> FlatKdTree<Item>::neighborsSearch(const Item& item,
+                                                    std::size_t num_neighbors,
+                                                    bool reverse_search,
+                                                    double approx_epsilon) const
+{
+    std::vector<Item> out;
+    out.reserve(std::min(num_neighbors, items_.size()));
+
+    visitNeighbors(item,
+                   num_neighbors,
+                   reverse_search,
+                   [&out](SquaredDistance, const Item* neighbor){ out.push_back(*neighbor); },
+                   approx_epsilon);
+
+    return out;
+}
+
+template<class Item>
+template<class Visitor>
+requires std::invocable<Visitor&, typename FlatKdTree<Item>::SquaredDistance, const Item*>
+std::size_t FlatKdTree<Item>::visitNeighbors(const Item& item,
+                                             std::size_t num_neighbors,
+                                             bool reverse_search,
+                                             Visitor&& visitor,
+                                             double approx_epsilon) const
+{
+    QueryWorkspace workspace;
+
+    return visitNeighbors(workspace,
+                          item,
+                          num_neighbors,
+                          reverse_search,
+                          std::forward<Visitor>(visitor),
+                          approx_epsilon);
+}
+
+template<class Item>
+template<class Visitor>
+requires std::invocable<Visitor&, typename FlatKdTree<Item>::SquaredDistance, const Item*>
+std::size_t FlatKdTree<Item>::visitNeighbors(QueryWorkspace& workspace,
+                                             const Item& item,
+                                             std::size_t num_neighbors,
+                                             bool reverse_search,
+                                             Visitor&& visitor,
+                                             double approx_epsilon) const
+{
+    if (items_.empty()
+        or num_neighbors == 0)
+        return 0;
+
+    // Данные сессии поиска принадлежат вызывающему потоку,
+    // поэтому запросы к одному дереву могут быть параллельными.
+    NnsSessProps session{item, num_neighbors, approx_epsilon, workspace.neighbors};
+
+    try
+    {
+        search(session, reverse_search);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        return 0;
+    }
+
+    auto& neighbors = session.neighbors;
+    neighbors.sort();
+
+    for (const auto& neighbor : neighbors)
+        visitor(neighbor.first, neighbor.second);
+
+    return neighbors.size();
+}
+
+template<class Item>
+std::vector<Item> FlatKdTree<Item>::shepardInterpolation(Item& item,
+                                                         std::size_t num_neighbors,
+                                                         bool reverse_search,
+                                                         double idw_power,
+                                                         double approx_epsilon) const
+{
+    std::vector<Item> out;
+    item.setValue(interpolate(item,
+                              num_neighbors,
+                              reverse_search,
+                              idw_power,
+                              approx_epsilon,
+                              &out));
+
+    return out;
+}
+
+template<class Item>
+typename FlatKdTree<Item>::Value FlatKdTree<Item>::interpolate(const Item& item,
+                                                               std::size_t num_neighbors,
+                                                               bool reverse_search,
+                                                               double idw_power,
+                                                               double approx_epsilon,
+                                                               std::vector<Item>* neighbors) const
+{
+    QueryWorkspace workspace;
+
+    return interpolate(workspace,
+                       item,
+                       num_neighbors,
+                       reverse_search,
+                       idw_power,
+                       approx_epsilon,
+                       neighbors);
+}
+
+template<class Item>
+typename FlatKdTree<Item>::Value FlatKdTree<Item>::interpolate(QueryWorkspace& workspace,
+                                                               const Item& item,
+                                                               std::size_t num_neighbors,
+                                                               bool reverse_search,
+                                                               double idw_power,
+                                                               double approx_epsilon,
+                                                               std::vector<Item>* neighbors) const
+{
+    if (neighbors)
+        neighbors->clear();
+
+    IdwAccumulator accumulator{idw_power};
+    [[maybe_unused]] const Item* match = nullptr;
+
+    auto visitor = [&](SquaredDistance distance, const Item* neighbor){
+#ifdef ZERO_DISTANCE_HANDLING
+        if (match)
+            return;
+
+        if (isZeroSquared(distance)) [[unlikely]]
+        {
+            match = neighbor;
+            if (neighbors)
+                neighbors->push_back(*neighbor);
+
+            return;
+        }
+
+        const auto squared_distance = static_cast<double>(distance);
+#else
+        const auto squared_distance = isZeroSquared(distance)
+                                      ? static_cast<double>(EPSILON<Distance> * EPSILON<Distance>)
+                                      : static_cast<double>(distance);
+#endif
+        accumulator.add(squared_distance, static_cast<double>(neighbor->getValue()));
+
+        if (neighbors)
+            neighbors->push_back(*neighbor); };
+
+    if (visitNeighbors(workspace, item, num_neighbors, reverse_search, visitor, approx_epsilon) == 0)
+        return item.getValue();
+
+#ifdef ZERO_DISTANCE_HANDLING
+    if (match)
+        return match->getValue();
+#endif
+
+    return static_cast<Value>(accumulator.getMean());
+}
+
+template<class Item>
+std::vector<Item> FlatKdTree<Item>::bestBinFirstSearch(const Item& item,
+                                                       std::size_t num_neighbors,
+                                                       std::size_t max_checks,
+                                                       bool& exact) const
+{
+    exact = true;
+
+    if (items_.empty()
+        or num_neighbors == 0)
+        return {};
+
+    QueryWorkspace workspace;
+    NnsSessProps session{item, num_neighbors, 0.0, workspace.neighbors};
+
+    try
+    {
+        exact = bestBinFirstSearch(session, max_checks);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        exact = false;
+
+        return {};
+    }
+
+    auto& neighbors = session.neighbors;
+    neighbors.sort();
+
+    std::vector<Item> out;
+    out.reserve(neighbors.size());
+    for (const auto& neighbor : neighbors)
+        out.push_back(*neighbor.second);
+
+    return out;
+}
+
+template<class Item>
+std::size_t FlatKdTree<Item>::radiusSearch(const Item& item,
+                                           Distance radius,
+                                           std::vector<const Item*>& neighbors) const
+{
+    neighbors.clear();
+
+    if (items_.empty())
+        return 0;
+
+    try
+    {
+        auto visitor = [&neighbors](const Item* neighbor){ neighbors.push_back(neighbor); };
+        rangeSearch(getRoot(), item, radius, visitor);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        neighbors.clear();
+    }
+
+    return neighbors.size();
+}
+
+template<class Item>
+std::size_t FlatKdTree<Item>::rangeCount(const Item& item,
+                                         Distance radius) const
+{
+    if (items_.empty())
+        return 0;
+
+    std::size_t count = 0;
+
+    try
+    {
+        auto visitor = [&count](const Item*){ ++count; };
+        rangeSearch(getRoot(), item, radius, visitor);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        return 0;
+    }
+
+    return count;
+}
+
+template<class Item>
+auto FlatKdTree<Item>::getComparator(std::size_t dimension) noexcept
+{
+    return [dimension](const Item& lhs, const Item& rhs)->bool{
+               return lhs.compareLess(rhs, dimension); };
+}
+
+template<class Item>
+constexpr std::size_t FlatKdTree<Item>::getItemsOffset() noexcept
+{
+    return alignFileOffset(sizeof(FileHeader));
+}
+
+template<class Item>
+std::size_t FlatKdTree<Item>::getCoordsOffset(std::size_t num_items,
+                                              std::size_t axis) noexcept
+{
+    return alignFileOffset(getItemsOffset() + num_items * sizeof(Item))
+           + axis * alignFileOffset(num_items * sizeof(Coord));
+}
+
+template<class Item>
+typename FlatKdTree<Item>::Node FlatKdTree<Item>::getRoot() const noexcept
+{
+    return Node{0, items_.size(), 0};
+}
+
+template<class Item>
+void FlatKdTree<Item>::buildTree(std::vector<Item>& items,
+                                 const Node& node,
+                                 std::size_t num_threads) const
+{
+    if (node.isEmpty() or node.isLeaf(leaf_size_))
+        return;
+
+    // Полная сортировка не нужна: достаточно, чтобы медиана встала на своё
+    // место, а элементы слева и справа от неё были не больше и не меньше её
+    // соответственно, что и делает std::nth_element() за линейное время.
+    std::nth_element(items.begin() + node.first,
+                     items.begin() + node.median,
+                     items.begin() + node.last,
+                     getComparator(node.dimension));
+
+    // Поддеревья занимают непересекающиеся отрезки массива,
+    // поэтому их можно упорядочивать параллельно без блокировок.
+    if (num_threads > 1
+        and node.last - node.first >= PARALLEL_BUILD_CUTOFF)
+    {
+        auto future = std::async(std::launch::async,
+                                 &FlatKdTree::buildTree, this,
+                                 std::ref(items), node.getLeft(), num_threads / 2);
+
+        buildTree(items, node.getRight(), num_threads - num_threads / 2);
+        future.get();
+    }
+    else
+    {
+        buildTree(items, node.getLeft(), 1);
+        buildTree(items, node.getRight(), 1);
+    }
+}
+
+template<class Item>
+void FlatKdTree<Item>::fillCoords(Buffers& buffers)
+{
+    const auto& items = buffers.items;
+    for (std::size_t axis = 0; axis < Item::getNumAxes(); ++axis)
+    {
+        auto& coords = buffers.coords[axis];
+        coords.resize(items.size());
+        for (std::size_t i = 0; i < items.size(); ++i)
+            coords[i] = items[i].getCoord(axis);
+    }
+}
+
+template<class Item>
+void FlatKdTree<Item>::printTree(std::ostream& out,
+                                 const Node& node,
+                                 std::size_t depth) const
+{
+    if (node.isLeaf(leaf_size_))
+    {
+        for (auto i = node.first; i < node.last; ++i)
+            out << "\x1b[1;31m" << depth << "\x1b[0m\t"
+                << "\x1b[1;32m" << items_[i] << "\x1b[0m\n";
+
+        return;
+    }
+
+    if (const auto left = node.getLeft(); !left.isEmpty())
+        printTree(out, left, depth + 1);
+
+    out << "\x1b[1;31m" << depth << "\x1b[0m\t"
+        << "\x1b[1;32m" << items_[node.median] << "\x1b[0m\n";
+
+    if (const auto right = node.getRight(); !right.isEmpty())
+        printTree(out, right, depth + 1);
+}
+
+template<class Item>
+std::ostream& operator<<(std::ostream& out, const FlatKdTree<Item>& tree)
+{
+    if (tree.items_.empty())
+        return out << "The tree is empty.\n";
+
+    out << "\x1b[1;41mFlatKdTree:\x1b[0m\n";
+    tree.printTree(out, tree.getRoot(), 0);
+
+    return out;
+}
+
+template<class Item>
+void FlatKdTree<Item>::search(NnsSessProps& session,
+                              bool reverse_search) const
+{
+    if (reverse_search)
+        reverseSearch(session);
+    else
+        forwardSearch(session);
+}
+
+template<class Item>
+void FlatKdTree<Item>::forwardSearch(NnsSessProps& session) const
+{
+    typename NnsSessProps::Stack branches;
+    std::size_t size = 0;
+
+    Node node = getRoot();
+    while (!node.isEmpty())
+    {
+        // Спуск к листу по ближней стороне, а дальняя откладывается
+        while (!node.isLeaf(leaf_size_))
+        {
+            const Item* median = &items_[node.median];
+
+            session.updateQueue(median);
+
+            Node next_node = node.getRight(), aux_node = node.getLeft();
+            if (session.item.compareLess(*median, node.dimension))
+                std::swap(next_node, aux_node);
+
+            if (!aux_node.isEmpty())
+                branches[size++] = {median, aux_node.first, aux_node.last, aux_node.dimension,
+                                    session.item.getSquaredDistance(*median, node.dimension)};
+
+            node = next_node;
+        }
+
+        if (!node.isEmpty())
+            scanLeaf(session, node);
+
+        // Ветви снимаются в порядке возврата из рекурсии (см. KdTree)
+        node = Node{0, 0, 0};
+        while (node.isEmpty() && size != 0)
+        {
+            const auto branch = branches[--size];
+            if (session.isAuxRequired(branch.distance))
+                node = Node{branch.first, branch.last, branch.dimension};
+        }
+    }
+}
+
+template<class Item>
+void FlatKdTree<Item>::reverseSearch(NnsSessProps& session) const
+{
+    typename NnsSessProps::Stack branches;
+    std::size_t size = 0;
+
+    Node node = getRoot();
+    while (!node.isEmpty())
+    {
+        while (!node.isLeaf(leaf_size_))
+        {
+            const Item* median = &items_[node.median];
+
+            // Левое поддерево непустое всегда, если узел не лист,
+            // так как медиана - это середина отрезка с округлением
+            // в меньшую сторону, а пустым может быть только правое.
+            Node next_node = node.getLeft(), aux_node = node.getRight();
+            if (!aux_node.isEmpty()
+                && !session.item.compareLess(*median, node.dimension))
+                std::swap(next_node, aux_node);
+
+            branches[size++] = {median, aux_node.first, aux_node.last, aux_node.dimension,
+                                aux_node.isEmpty() ? SquaredDistance{}
+                                                   : session.item.getSquaredDistance(*median, node.dimension)};
+
+            node = next_node;
+        }
+
+        scanLeaf(session, node);
+
+        node = Node{0, 0, 0};
+        while (node.isEmpty() && size != 0)
+        {
+            const auto branch = branches[--size];
+
+            session.updateQueue(branch.median);
+
+            if (branch.first < branch.last && session.isAuxRequired(branch.distance))
+                node = Node{branch.first, branch.last, branch.dimension};
+        }
+    }
+}
+
+template<class Item>
+void FlatKdTree<Item>::scanLeaf(NnsSessProps& session,
+                                const Node& node) const
+{
+    if (leaf_size_ == 1)
+    {
+        session.updateQueue(&items_[node.first]);
+
+        return;
+    }
+
+    const std::size_t count = node.last - node.first;
+
+    std::array<const Coord*, Item::getNumAxes()> coords;
+    for (std::size_t axis = 0; axis < coords.size(); ++axis)
+        coords[axis] = coords_[axis].data() + node.first;
+
+    double distances[MAX_LEAF_SIZE];
+    getSquaredDistances(coords, session.coords, count, distances);
+
+    // Точное расстояние вычисляется только для тех точек, которые
+    // ближе самого дальнего из найденных соседей с запасом на погрешность
+    // округления, как и в scanRange(): квадраты в double точны не всегда,
+    // поэтому окончательно точку сравнивает updateQueue().
+    auto& neighbors = session.neighbors;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (neighbors.isFull()
+            && distances[i] > static_cast<double>(neighbors.top().first) * (1.0 + 1.0E-9))
+            continue;
+
+        session.updateQueue(&items_[node.first + i]);
+    }
+}
+
+template<class Item>
+bool FlatKdTree<Item>::bestBinFirstSearch(NnsSessProps& session,
+                                          std::size_t max_checks) const
+{
+    // Нижняя граница квадрата расстояния до точек поддерева
+    // и само поддерево, как и в KdTree::bestBinFirstSearch()
+    using Branch = std::pair<SquaredDistance, Node>;
+    auto compareGreater = [](const Branch& lhs, const Branch& rhs){
+        return lhs.first > rhs.first; };
+
+    std::vector<Branch> branches{{SquaredDistance(0), getRoot()}};
+    std::size_t num_checks = 0;
+
+    while (!branches.empty())
+    {
+        std::pop_heap(branches.begin(), branches.end(), compareGreater);
+        auto [bound, node] = branches.back();
+        branches.pop_back();
+
+        const auto& neighbors = session.neighbors;
+        if (neighbors.isFull() && not (bound < neighbors.top().first))
+            return true;
+
+        while (!node.isEmpty())
+        {
+            if (max_checks != 0 && num_checks >= max_checks)
+                return false;
+
+            if (node.isLeaf(leaf_size_))
+            {
+                num_checks += node.last - node.first;
+                scanLeaf(session, node);
+
+                break;
+            }
+
+            const Item* median = &items_[node.median];
+
+            ++num_checks;
+            session.updateQueue(median);
+
+            Node next_node = node.getRight(), aux_node = node.getLeft();
+            if (session.item.compareLess(*median, node.dimension))
+                std::swap(next_node, aux_node);
+
+            if (!aux_node.isEmpty())
+            {
+                const auto distance = session.item.getSquaredDistance(*median, node.dimension);
+                const auto aux_bound = std::max(bound, distance);
+                if (!neighbors.isFull() || aux_bound < neighbors.top().first)
+                {
+                    branches.emplace_back(aux_bound, aux_node);
+                    std::push_heap(branches.begin(), branches.end(), compareGreater);
+                }
+            }
+
+            node = next_node;
+        }
+    }
+
+    return true;
+}
+
+template<class Item>
+template<class Visitor>
+void FlatKdTree<Item>::rangeSearch(const Node& node,
+                                   const Item& item,
+                                   Distance radius,
+                                   Visitor& visitor) const
+{
+    if (node.isLeaf(leaf_size_))
+    {
+        scanRange(node, item, radius, visitor);
+
+        return;
+    }
+
+    const Item& median = items_[node.median];
+
+    // Корень извлекается только для точек, прошедших отсев по квадрату
+    // радиуса с запасом на погрешность округления, как и в scanRange()
+    const double bound = static_cast<double>(radius) * static_cast<double>(radius) * (1.0 + 1.0E-9);
+    if (static_cast<double>(item.getSquaredDistance(median)) <= bound
+        && item.getDistance(median) <= radius)
+        visitor(&median);
+
+    // Поддерево по другую сторону от плоскости разбиения, чем
+    // искомая точка, пропускается, если плоскость дальше радиуса.
+    const auto distance = static_cast<Distance>(item.getDistance(median, node.dimension));
+
+    if (const auto left = node.getLeft(); !left.isEmpty() && distance <= radius)
+        rangeSearch(left, item, radius, visitor);
+
+    if (const auto right = node.getRight(); !right.isEmpty() && -distance <= radius)
+        rangeSearch(right, item, radius, visitor);
+}
+
+template<class Item>
+template<class Visitor>
+void FlatKdTree<Item>::scanRange(const Node& node,
+                                 const Item& item,
+                                 Distance radius,
+                                 Visitor& visitor) const
+{
+    // Квадрат радиуса с запасом на погрешность округления: отсев по нему
+    // только грубый, а окончательно точка проверяется так же, как и в
+    // остальных узлах, поэтому результат не зависит от размера листьев.
+    const double bound = static_cast<double>(radius) * static_cast<double>(radius) * (1.0 + 1.0E-9);
+
+    if (leaf_size_ == 1)
+    {
+        if (static_cast<double>(item.getSquaredDistance(items_[node.first])) <= bound
+            and item.getDistance(items_[node.first]) <= radius)
+            visitor(&items_[node.first]);
+
+        return;
+    }
+
+    const std::size_t count = node.last - node.first;
+
+    std::array<const Coord*, Item::getNumAxes()> coords;
+    std::array<double, Item::getNumAxes()> target;
+    for (std::size_t axis = 0; axis < coords.size(); ++axis)
+    {
+        coords[axis] = coords_[axis].data() + node.first;
+        target[axis] = static_cast<double>(item.getCoord(axis));
+    }
+
+    double distances[MAX_LEAF_SIZE];
+    getSquaredDistances(coords, target, count, distances);
+
+    for (std::size_t i = 0; i < count; ++i)
+        if (distances[i] <= bound
+            and item.getDistance(items_[node.first + i]) <= radius)
+            visitor(&items_[node.first + i]);
+}
+
+
+template<class Item>
+FlatKdTree<Item>::Node::Node(std::size_t first,
+                             std::size_t last,
+                             std::size_t dimension) noexcept
+    : first(first)
+    , median(first + (last - first) / 2)
+    , last(last)
+    , dimension(dimension)
+{
+}
+
+template<class Item>
+typename FlatKdTree<Item>::Node FlatKdTree<Item>::Node::getLeft() const noexcept
+{
+    return Node{first, median, (dimension + 1) % Item::getNumAxes()};
+}
+
+template<class Item>
+typename FlatKdTree<Item>::Node FlatKdTree<Item>::Node::getRight() const noexcept
+{
+    return Node{median + 1, last, (dimension + 1) % Item::getNumAxes()};
+}
+
+template<class Item>
+bool FlatKdTree<Item>::Node::isEmpty() const noexcept
+{
+    return first >= last;
+}
+
+template<class Item>
+bool FlatKdTree<Item>::Node::isLeaf(std::size_t leaf_size) const noexcept
+{
+    return last - first <= leaf_size;
+}
+
+
+template<class Item>
+FlatKdTree<Item>::NnsSessProps::NnsSessProps(const Item& item,
+                                             std::size_t num_neighbors,
+                                             double approx_epsilon,
+                                             Heap& heap)
+    : item(item)
+    , neighbors(heap)
+    , prune_factor((1.0 + std::max(approx_epsilon, 0.0)) * (1.0 + std::max(approx_epsilon, 0.0)))
+{
+    neighbors.reset(num_neighbors);
+
+    for (std::size_t axis = 0; axis < coords.size(); ++axis)
+        coords[axis] = static_cast<double>(item.getCoord(axis));
+}
+
+template<class Item>
+void FlatKdTree<Item>::NnsSessProps::updateQueue(const Item* neighbor)
+{
+    const auto distance = item.getSquaredDistance(*neighbor);
+    if (!neighbors.isFull())
+        neighbors.push({distance, neighbor});
+    else if (distance < neighbors.top().first)
+        neighbors.replaceTop({distance, neighbor});
+}
+
+template<class Item>
+bool FlatKdTree<Item>::NnsSessProps::isAuxRequired(typename Pair::first_type distance) const
+{
+    if (!neighbors.isFull())
+        return true;
+
+    if (prune_factor > 1.0 ? distance * prune_factor < neighbors.top().first
+                           : distance < neighbors.top().first)
+        return true;
+
+    return false;
+}
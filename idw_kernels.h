@@ -0,0 +1,330 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#include <array>
+#include <utility>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// Веса метода ОВР (Шепарда) w = d^-p по квадратам расстояний d^2. Для
+// целых и полуцелых степеней до MAX_TWICE_POWER / 2 вес вычисляется без
+// pow() по несколько соседей за раз: целая часть (1 / d^2)^(p/2) - это
+// умножения, а остаток - корень 1 / d и, для полуцелых p, корень из него.
+// Для остальных степеней используется std::pow(), для которого нет
+// переносимой векторной версии.
+class IdwKernel final
+{
+public:
+    static constexpr unsigned MAX_TWICE_POWER = 16U;
+
+    explicit IdwKernel(double idw_power) noexcept;
+
+    void computeWeights(const double* squared_distances,
+                        std::size_t count,
+                        double* weights) const noexcept;
+
+private:
+    using Function = void (*)(const double*, std::size_t, double, double*);
+
+    template<unsigned TWICE_POWER>
+    static void computePowerWeights(const double* squared_distances,
+                                    std::size_t count,
+                                    double,
+                                    double* weights) noexcept;
+
+    static void computeGenericWeights(const double* squared_distances,
+                                      std::size_t count,
+                                      double half_power,
+                                      double* weights) noexcept;
+
+    template<std::size_t... Is>
+    static constexpr std::array<Function, sizeof...(Is)>
+    makeFunctions(std::index_sequence<Is...>) noexcept;
+
+    Function function_;
+    double half_power_;
+};
+
+// Взвешенное среднее значений соседей: соседи накапливаются в буфере и
+// обрабатываются пачками - сначала веса IdwKernel, затем суммы весов и
+// взвешенных значений по LANES независимым дорожкам, каждая со своей
+// компенсацией погрешности (TwoSum), т.е. в double, но без потери
+// точности, от которой раньше спасал long double. Сосед с номером i
+// всегда попадает в дорожку i % LANES, поэтому результат от набора
+// инструкций не зависит. Дорожки в конце складываются тоже с компенсацией.
+// Проект собирается с -Ofast, которое разрешает переставлять сложения и
+// выбросило бы компенсацию, поэтому для методов IdwAccumulator это
+// отключено (см. IDW_PRECISE_BEGIN).
+class IdwAccumulator final
+{
+public:
+    static constexpr std::size_t BATCH_SIZE = 64UL;
+    static constexpr std::size_t LANES = 4UL;
+
+    explicit IdwAccumulator(double idw_power) noexcept;
+
+    void add(double squared_distance, double value) noexcept;
+
+    // Среднее уже добавленных соседей
+    double getMean() noexcept;
+
+private:
+    void flush() noexcept;
+
+    // TwoSum: sum + error + x = новые sum + error точно
+    static void addCompensated(double& sum, double& error, double x) noexcept;
+
+    IdwKernel kernel_;
+    std::size_t size_{0};
+    alignas(32) double squared_distances_[BATCH_SIZE];
+    alignas(32) double values_[BATCH_SIZE];
+    alignas(32) double weights_[BATCH_SIZE];
+    // Суммы и их погрешности по дорожкам
+    alignas(32) double num_[LANES]{};
+    alignas(32) double num_error_[LANES]{};
+    alignas(32) double den_[LANES]{};
+    alignas(32) double den_error_[LANES]{};
+};
+
+
+template<std::size_t... Is>
+constexpr std::array<IdwKernel::Function, sizeof...(Is)>
+IdwKernel::makeFunctions(std::index_sequence<Is...>) noexcept
+{
+    return {&computePowerWeights<static_cast<unsigned>(Is)>...};
+}
+
+inline IdwKernel::IdwKernel(double idw_power) noexcept
+    : function_(&computeGenericWeights)
+    , half_power_(0.5 * idw_power)
+{
+    static constexpr auto functions = makeFunctions(std::make_index_sequence<MAX_TWICE_POWER + 1>());
+
+    const double twice_power = 2.0 * idw_power;
+    if (twice_power >= 0.0
+        && twice_power <= MAX_TWICE_POWER
+        && twice_power == std::floor(twice_power))
+        function_ = functions[static_cast<std::size_t>(twice_power)];
+}
+
+inline void IdwKernel::computeWeights(const double* squared_distances,
+                                      std::size_t count,
+                                      double* weights) const noexcept
+{
+    function_(squared_distances, count, half_power_, weights);
+}
+
+template<unsigned TWICE_POWER>
+void IdwKernel::computePowerWeights(const double* squared_distances,
+                                    std::size_t count,
+                                    double,
+                                    double* weights) noexcept
+{
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m256d inverse = _mm256_div_pd(_mm256_set1_pd(1.0),
+                                              _mm256_loadu_pd(squared_distances + i));
+        __m256d weight = _mm256_set1_pd(1.0);
+        if constexpr (TWICE_POWER % 4 != 0)
+        {
+            const __m256d root = _mm256_sqrt_pd(inverse);
+            if constexpr (TWICE_POWER % 4 >= 2)
+                weight = root;
+            if constexpr (TWICE_POWER % 2 != 0)
+                weight = _mm256_mul_pd(weight, _mm256_sqrt_pd(root));
+        }
+        for (unsigned j = 0; j < TWICE_POWER / 4; ++j)
+            weight = _mm256_mul_pd(weight, inverse);
+
+        _mm256_storeu_pd(weights + i, weight);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 2 <= count; i += 2)
+    {
+        const __m128d inverse = _mm_div_pd(_mm_set1_pd(1.0),
+                                           _mm_loadu_pd(squared_distances + i));
+        __m128d weight = _mm_set1_pd(1.0);
+        if constexpr (TWICE_POWER % 4 != 0)
+        {
+            const __m128d root = _mm_sqrt_pd(inverse);
+            if constexpr (TWICE_POWER % 4 >= 2)
+                weight = root;
+            if constexpr (TWICE_POWER % 2 != 0)
+                weight = _mm_mul_pd(weight, _mm_sqrt_pd(root));
+        }
+        for (unsigned j = 0; j < TWICE_POWER / 4; ++j)
+            weight = _mm_mul_pd(weight, inverse);
+
+        _mm_storeu_pd(weights + i, weight);
+    }
+#endif
+
+    // Остаток - так же, как и в векторных дорожках
+    for (; i < count; ++i)
+    {
+        const double inverse = 1.0 / squared_distances[i];
+        double weight = 1.0;
+        if constexpr (TWICE_POWER % 4 != 0)
+        {
+            const double root = std::sqrt(inverse);
+            if constexpr (TWICE_POWER % 4 >= 2)
+                weight = root;
+            if constexpr (TWICE_POWER % 2 != 0)
+                weight *= std::sqrt(root);
+        }
+        for (unsigned j = 0; j < TWICE_POWER / 4; ++j)
+            weight *= inverse;
+
+        weights[i] = weight;
+    }
+}
+
+inline void IdwKernel::computeGenericWeights(const double* squared_distances,
+                                             std::size_t count,
+                                             double half_power,
+                                             double* weights) noexcept
+{
+    for (std::size_t i = 0; i < count; ++i)
+        weights[i] = std::pow(squared_distances[i], -half_power);
+}
+
+
+// Точная арифметика с плавающей точкой независимо от флагов сборки: без
+// перестановки сложений, на которой держится компенсация погрешности.
+// Функции из этой области не встраиваются в функции с другими флагами.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define IDW_PRECISE_BEGIN __pragma(float_control(precise, on, push))
+#define IDW_PRECISE_END __pragma(float_control(pop))
+#elif defined(__clang__)
+#define IDW_PRECISE_BEGIN _Pragma("float_control(precise, on, push)")
+#define IDW_PRECISE_END _Pragma("float_control(pop)")
+#elif defined(__GNUC__)
+#define IDW_PRECISE_BEGIN _Pragma("GCC push_options") _Pragma("GCC optimize(\"no-fast-math\")")
+#define IDW_PRECISE_END _Pragma("GCC pop_options")
+#else
+#define IDW_PRECISE_BEGIN
+#define IDW_PRECISE_END
+#endif
+
+IDW_PRECISE_BEGIN
+
+inline IdwAccumulator::IdwAccumulator(double idw_power) noexcept
+    : kernel_(idw_power)
+{
+}
+
+inline void IdwAccumulator::add(double squared_distance, double value) noexcept
+{
+    squared_distances_[size_] = squared_distance;
+    values_[size_] = value;
+
+    if (++size_ == BATCH_SIZE)
+        flush();
+}
+
+inline double IdwAccumulator::getMean() noexcept
+{
+    flush();
+
+    double num = 0.0, num_error = 0.0, den = 0.0, den_error = 0.0;
+    for (std::size_t lane = 0; lane < LANES; ++lane)
+    {
+        addCompensated(num, num_error, num_[lane]);
+        addCompensated(den, den_error, den_[lane]);
+        num_error += num_error_[lane];
+        den_error += den_error_[lane];
+    }
+
+    return (num + num_error) / (den + den_error);
+}
+
+inline void IdwAccumulator::flush() noexcept
+{
+    if (size_ == 0)
+        return;
+
+    kernel_.computeWeights(squared_distances_, size_, weights_);
+
+    // Пачка полная, кроме последней, поэтому номера дорожек
+    // в ней совпадают с номерами дорожек во всей сумме.
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d num = _mm256_load_pd(num_), num_error = _mm256_load_pd(num_error_);
+    __m256d den = _mm256_load_pd(den_), den_error = _mm256_load_pd(den_error_);
+
+    // TwoSum: sum + x = t + ((sum - (t - z)) + (x - z)) точно
+    auto addLanes = [](__m256d& sum, __m256d& error, __m256d x){
+        const __m256d t = _mm256_add_pd(sum, x);
+        const __m256d z = _mm256_sub_pd(t, sum);
+        error = _mm256_add_pd(error, _mm256_add_pd(_mm256_sub_pd(sum, _mm256_sub_pd(t, z)),
+                                                   _mm256_sub_pd(x, z)));
+        sum = t; };
+
+    for (; i + LANES <= size_; i += LANES)
+    {
+        const __m256d weight = _mm256_load_pd(weights_ + i);
+        addLanes(num, num_error, _mm256_mul_pd(weight, _mm256_load_pd(values_ + i)));
+        addLanes(den, den_error, weight);
+    }
+
+    _mm256_store_pd(num_, num);
+    _mm256_store_pd(num_error_, num_error);
+    _mm256_store_pd(den_, den);
+    _mm256_store_pd(den_error_, den_error);
+#elif defined(__SSE2__) || defined(_M_X64)
+    auto addLanes = [](__m128d& sum, __m128d& error, __m128d x){
+        const __m128d t = _mm_add_pd(sum, x);
+        const __m128d z = _mm_sub_pd(t, sum);
+        error = _mm_add_pd(error, _mm_add_pd(_mm_sub_pd(sum, _mm_sub_pd(t, z)),
+                                             _mm_sub_pd(x, z)));
+        sum = t; };
+
+    for (std::size_t half = 0; half < LANES; half += 2)
+    {
+        __m128d num = _mm_load_pd(num_ + half), num_error = _mm_load_pd(num_error_ + half);
+        __m128d den = _mm_load_pd(den_ + half), den_error = _mm_load_pd(den_error_ + half);
+
+        for (std::size_t j = 0; j + LANES <= size_; j += LANES)
+        {
+            const __m128d weight = _mm_load_pd(weights_ + j + half);
+            addLanes(num, num_error, _mm_mul_pd(weight, _mm_load_pd(values_ + j + half)));
+            addLanes(den, den_error, weight);
+        }
+
+        _mm_store_pd(num_ + half, num);
+        _mm_store_pd(num_error_ + half, num_error);
+        _mm_store_pd(den_ + half, den);
+        _mm_store_pd(den_error_ + half, den_error);
+    }
+
+    i = size_ / LANES * LANES;
+#endif
+
+    // Остаток, а также сборка без SIMD
+    for (; i < size_; ++i)
+    {
+        const std::size_t lane = i % LANES;
+        addCompensated(num_[lane], num_error_[lane], weights_[i] * values_[i]);
+        addCompensated(den_[lane], den_error_[lane], weights_[i]);
+    }
+
+    size_ = 0;
+}
+
+inline void IdwAccumulator::addCompensated(double& sum, double& error, double x) noexcept
+{
+    const double t = sum + x;
+    const double z = t - sum;
+    error += (sum - (t - z)) + (x - z);
+    sum = t;
+}
+
+IDW_PRECISE_END
@@ -1,92 +1,299 @@
 ﻿#pragma once
 
+#include <cstdint>
+#include <cstring>
+
+#include <bit>
 #include <array>
+#include <cmath>
+#include <limits>
 #include <vector>
 #include <string>
-
-#ifndef ALLOW_DUPLICATE_POINTS
-#include <set>
-#endif
+#include <numeric>
+#include <charconv>
+#include <algorithm>
+#include <type_traits>
 
 #include <fstream>
+#include <iostream>
 
 #include <exception>
 
 #include <nlohmann/json.hpp>
 
 #include "point.h"
+#include "mapped_file.h"
 
+// Заголовок двоичного файла точек. За ним с выравниванием FILE_ALIGNMENT
+// идут столбцы: num_points координат по каждой из осей и num_points
+// значений. Все числа записаны в порядке байтов машины, сохранившей файл.
+struct PointsFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t num_axes;
+    std::uint32_t coord_type;
+    std::uint32_t value_type;
+    std::uint32_t reserved;
+    std::uint64_t num_points;
+};
+
+inline constexpr char POINTS_FILE_MAGIC[] = "PIPOINTS";
+inline constexpr std::uint32_t POINTS_FILE_VERSION = 1U;
+
+// Смещение столбца с номером column: оси идут по порядку,
+// а столбец значений - последний, его номер равен числу осей.
+template<class C>
+std::size_t getPointsColumnOffset(std::size_t num_points,
+                                  std::size_t column) noexcept
+{
+    return alignFileOffset(sizeof(PointsFileHeader))
+           + column * alignFileOffset(num_points * sizeof(C));
+}
+
+// Удаляет из вектора точки, равные по координатам какой-либо из предыдущих,
+// сохраняя порядок оставшихся (из равных точек остаётся первая). Целые
+// координаты хешируются и ищутся в таблице индексов с открытой адресацией,
+// в которой индексы - это уже новые места точек в векторе, поэтому он
+// сжимается тем же проходом. Координаты с плавающей точкой равны с точностью
+// до эпсилон, т.е. не хешируются, поэтому индексы точек сортируются, как их
+// упорядочивает compareLess(), и из каждой группы равных остаётся первая.
 template<class C, class V, std::size_t N>
-bool readPoints(std::ifstream& file,
-                std::vector<Point<C, V, N>>& points,
-                const std::array<const char*, N>& axis_names,
-                const char* value_name)
+void removeDuplicatePoints(std::vector<Point<C, V, N>>& points)
 {
-    using json = nlohmann::json;
+    if (points.size() < 2)
+        return;
 
-    const json data = json::parse(file);
-    if (!data.is_array() || data.empty())
+    if constexpr (std::is_integral_v<C>)
     {
-        std::cerr << "The file is ill-formed!\n";
+        auto getHash = [](const Point<C, V, N>& point){
+            std::uint64_t hash = 0;
+            for (std::size_t i = 0; i < N; ++i)
+            {
+                // Финализатор SplitMix64
+                hash += static_cast<std::uint64_t>(static_cast<std::make_unsigned_t<C>>(point.getCoord(i)))
+                        + 0x9E3779B97F4A7C15ULL;
+                hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+                hash ^= hash >> 31;
+            }
 
-        return false;
+            return hash;
+        };
+
+        // Таблица заполнена не более чем на две трети, а индексы
+        // 32-битные, если их хватает, - так она вдвое меньше.
+        auto removeDuplicates = [&points, &getHash]<class Index>(Index){
+            constexpr Index EMPTY = std::numeric_limits<Index>::max();
+
+            const std::size_t mask = std::bit_ceil(points.size() + points.size() / 2) - 1;
+            std::vector<Index> table(mask + 1, EMPTY);
+
+            std::size_t size = 0;
+            for (std::size_t i = 0; i < points.size(); ++i)
+            {
+                std::size_t slot = getHash(points[i]) & mask;
+                while (table[slot] != EMPTY && !points[table[slot]].compareEqual(points[i]))
+                    slot = (slot + 1) & mask;
+
+                if (table[slot] != EMPTY)
+                    continue;
+
+                table[slot] = static_cast<Index>(size);
+                if (size != i)
+                    points[size] = points[i];
+                ++size;
+            }
+
+            points.resize(size);
+        };
+
+        if (points.size() < std::numeric_limits<std::uint32_t>::max())
+            removeDuplicates(std::uint32_t{});
+        else
+            removeDuplicates(std::size_t{});
     }
+    else
+    {
+        std::vector<std::size_t> order(points.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&points](std::size_t lhs, std::size_t rhs){
+            if (points[lhs].compareLess(points[rhs]))
+                return true;
+            if (points[rhs].compareLess(points[lhs]))
+                return false;
 
-    points.reserve(data.size());
+            return lhs < rhs; });
 
-#ifndef ALLOW_DUPLICATE_POINTS
-    struct CompareLess
+        std::vector<bool> duplicates(points.size());
+        for (std::size_t first = 0, i = 1; i < order.size(); ++i)
+            if (points[order[first]].compareLess(points[order[i]]))
+                first = i;
+            else
+                duplicates[order[i]] = true;
+
+        std::size_t size = 0;
+        for (std::size_t i = 0; i < points.size(); ++i)
+            if (!duplicates[i])
+                points[size++] = points[i];
+
+        points.resize(size);
+    }
+}
+
+// Точки читаются прямо из отображённого в память файла одним проходом по
+// столбцам, без разбора текста и поиска полей по именам осей.
+template<class C, class V, std::size_t N>
+bool readBinaryPoints(const MappedFile& file,
+                      std::vector<Point<C, V, N>>& points)
+{
+    const std::byte* data = file.getData();
+    const std::size_t size = file.getSize();
+
+    PointsFileHeader header{};
+    if (size >= alignFileOffset(sizeof(header)))
+        std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, POINTS_FILE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != POINTS_FILE_VERSION
+        || header.byte_order != BYTE_ORDER_MARK
+        || header.num_axes != N
+        || header.coord_type != getTypeTag<C>()
+        || header.value_type != getTypeTag<V>()
+        || header.num_points > size / (N * sizeof(C) + sizeof(V)))
     {
-        bool operator()(const Point<C, V, N>* lhs,
-                        const Point<C, V, N>* rhs) const noexcept
-        {
-            return lhs->compareLess(*rhs);
-        }
-    };
+        std::cerr << "The file is incompatible!\n";
 
-    std::set<const Point<C, V, N>*, CompareLess> unique_points;
-#endif
+        return false;
+    }
 
-    C coords[N]{};
-    for (const json& object : data)
+    const auto num_points = static_cast<std::size_t>(header.num_points);
+    if (size < getPointsColumnOffset<C>(num_points, N) + num_points * sizeof(V))
     {
-        if (!object.is_object() || object.size() < N)
-        {
-            std::cerr << "The array is invalid!\n";
+        std::cerr << "The file is truncated!\n";
+
+        return false;
+    }
 
-            points.clear();
+    const C* columns[N];
+    for (std::size_t i = 0; i < N; ++i)
+        columns[i] = reinterpret_cast<const C*>(data + getPointsColumnOffset<C>(num_points, i));
+    const V* values = reinterpret_cast<const V*>(data + getPointsColumnOffset<C>(num_points, N));
 
-            return false;
-        }
+    points.reserve(num_points);
 
-        json::const_iterator iterator;
+    C coords[N]{};
+    for (std::size_t j = 0; j < num_points; ++j)
+    {
         for (std::size_t i = 0; i < N; ++i)
-        {
-            iterator = object.find(axis_names[i]);
-            if (iterator == object.cend() || !iterator->is_number())
-            {
-                std::cerr << "The coordinate is missing!\n";
+            coords[i] = columns[i][j];
 
-                points.clear();
+        points.emplace_back(coords, values[j]);
+    }
 
-                return false;
-            }
+    return true;
+}
 
-            coords[i] = iterator.value().template get<C>();
-        }
+// Обработчик событий потокового (SAX) разбора массива точек: каждая точка
+// добавляется в вектор сразу, как только разобран её объект, поэтому, в
+// отличие от разбора в DOM, памяти сверх самого вектора почти не нужно.
+// Поля объекта, кроме осей и значения, пропускаются вместе с вложенными
+// массивами и объектами. Ошибки те же, что и при разборе в DOM: корень -
+// не массив или пустой массив, элемент массива - не объект или в нём меньше
+// N полей, координаты нет или она не число. Объект проверяется целиком, как
+// только закрыт, поэтому ошибка в нём сообщается раньше синтаксической
+// ошибки дальше в файле. Повторы полей осей и значения считаются одним
+// полем, а остальных полей - нет. Если значение не число, то оно нулевое.
+template<class C, class V, std::size_t N>
+class PointsSaxReader final
+{
+    using json = nlohmann::json;
 
-        V value{};
-        iterator = object.find(value_name);
-        if (iterator != object.cend() && iterator->is_number())
-            value = iterator.value().template get<V>();
+    // Номер поля: оси, затем значение, затем все остальные поля
+    static constexpr std::size_t VALUE_FIELD = N;
+    static constexpr std::size_t OTHER_FIELD = N + 1;
 
-        [[maybe_unused]]
-        auto const*const point = &points.emplace_back(coords, value);
+public:
+    PointsSaxReader(std::vector<Point<C, V, N>>& points,
+                    const std::array<const char*, N>& axis_names,
+                    const char* value_name);
 
-#ifndef ALLOW_DUPLICATE_POINTS
-        if (!unique_points.insert(point).second)
-            points.pop_back();
-#endif
+    bool null();
+
+    bool boolean(bool);
+
+    bool number_integer(json::number_integer_t number);
+
+    bool number_unsigned(json::number_unsigned_t number);
+
+    bool number_float(json::number_float_t number,
+                      const json::string_t&);
+
+    bool string(json::string_t&);
+
+    bool binary(json::binary_t&);
+
+    bool start_object(std::size_t);
+
+    bool key(json::string_t& key);
+
+    bool end_object();
+
+    bool start_array(std::size_t);
+
+    bool end_array();
+
+    bool parse_error(std::size_t,
+                     const std::string&,
+                     const json::exception& e);
+
+    // Причина, по которой разбор прерван
+    const std::string& getError() const noexcept;
+
+private:
+    template<class T>
+    bool setNumber(T number);
+
+    // Любое значение, кроме числа
+    bool setOther();
+
+    bool fail(const char* error);
+
+    std::vector<Point<C, V, N>>& points_;
+    const std::array<const char*, N>& axis_names_;
+    const char* value_name_;
+
+    // 0 - вне массива, 1 - в массиве, 2 - в объекте точки,
+    // больше - во вложенных в поле объекта массивах и объектах
+    std::size_t depth_{0};
+    std::size_t num_objects_{0};
+    std::size_t field_{OTHER_FIELD};
+    // Число полей объекта и поля осей и значения, которые в нём уже были
+    std::size_t num_keys_{0};
+    std::array<bool, N + 1> keys_{};
+    // Последнее значение поля оси - число
+    std::array<bool, N> found_{};
+    C coords_[N]{};
+    V value_{};
+
+    std::string error_;
+};
+
+template<class C, class V, std::size_t N>
+bool readPoints(std::ifstream& file,
+                std::vector<Point<C, V, N>>& points,
+                const std::array<const char*, N>& axis_names,
+                const char* value_name)
+{
+    PointsSaxReader<C, V, N> reader{points, axis_names, value_name};
+    if (!nlohmann::json::sax_parse(file, &reader))
+    {
+        std::cerr << reader.getError() << '\n';
+
+        points.clear();
+
+        return false;
     }
 
     return true;
@@ -97,7 +304,7 @@ std::vector<Point<C, V, N>> readPoints(const std::string& filename,
                                        const std::array<const char*, N>& axis_names,
                                        const char* value_name)
 {
-    std::ifstream file{filename};
+    std::ifstream file{filename, std::ios::binary};
     if (!file.is_open())
         return {};
 
@@ -105,7 +312,28 @@ std::vector<Point<C, V, N>> readPoints(const std::string& filename,
 
     try
     {
-        readPoints(file, points, axis_names, value_name);
+        // Двоичный файл отличается от JSON по первым байтам
+        char magic[sizeof(PointsFileHeader::magic)]{};
+        file.read(magic, sizeof(magic));
+
+        if (file.gcount() == sizeof(magic)
+            && std::memcmp(magic, POINTS_FILE_MAGIC, sizeof(magic)) == 0)
+        {
+            file.close();
+
+            readBinaryPoints(MappedFile{filename}, points);
+        }
+        else
+        {
+            file.clear();
+            file.seekg(0);
+
+            readPoints(file, points, axis_names, value_name);
+        }
+
+#ifndef ALLOW_DUPLICATE_POINTS
+        removeDuplicatePoints(points);
+#endif
     }
     catch (const std::exception& e)
     {
@@ -171,3 +399,484 @@ void writePoints(const std::string& filename,
 
     file.close();
 }
+
+// Проверка по битам показателя степени, а не std::isfinite(): с
+// -ffinite-math-only (входит в -Ofast) та всегда истинна. Число проверяется
+// после приведения к double, как его сохранил бы и nlohmann::json.
+template<class T>
+requires std::is_floating_point_v<T>
+bool isFiniteNumber(T number) noexcept
+{
+    constexpr std::uint64_t exponent_mask = 0x7FF0000000000000ULL;
+
+    return (std::bit_cast<std::uint64_t>(static_cast<double>(number)) & exponent_mask) != exponent_mask;
+}
+
+// Приёмник результата, который записывает точки в файл JSON по одной, по
+// мере их поступления, через буфер, а числа форматирует std::to_chars().
+// Файл получается таким же, как у writePoints(): поля в порядке имён, как
+// в nlohmann::json, и тот же отступ, но весь массив точек не строится в
+// памяти ни в виде DOM, ни в виде строки. Числа с плавающей точкой
+// записываются кратчайшим точным представлением, поэтому изредка на
+// последнюю цифру короче, чем у nlohmann::json, но читаются так же.
+template<class C, class V, std::size_t N>
+class JsonPointsWriter final
+{
+public:
+    static constexpr std::size_t BUFFER_SIZE = 1UL << 16;
+
+    JsonPointsWriter(const std::string& filename,
+                     int json_indent,
+                     const std::array<const char*, N>& axis_names,
+                     const char* value_name);
+
+    JsonPointsWriter(const JsonPointsWriter&) = delete;
+    JsonPointsWriter& operator=(const JsonPointsWriter&) = delete;
+
+    ~JsonPointsWriter();
+
+    bool isOpen() const noexcept;
+
+    void write(const Point<C, V, N>& point);
+
+    // Завершает массив и закрывает файл,
+    // false - если запись не удалась
+    bool close();
+
+private:
+    template<class T>
+    void writeNumber(T number);
+
+    void writeIndent(std::size_t depth);
+
+    void flush();
+
+    std::ofstream file_;
+    std::string buffer_;
+    int json_indent_;
+    // Имена полей в кавычках и номера осей (N - значение) в порядке имён
+    std::array<std::pair<std::string, std::size_t>, N + 1> fields_;
+    std::size_t num_points_{0};
+};
+
+template<class C, class V, std::size_t N>
+bool writeBinaryPoints(const std::string& filename,
+                       const std::vector<Point<C, V, N>>& points)
+{
+    std::ofstream file{filename, std::ios::binary};
+    if (!file.is_open())
+        return false;
+
+    try
+    {
+        PointsFileHeader header{};
+        std::memcpy(header.magic, POINTS_FILE_MAGIC, sizeof(header.magic));
+        header.version = POINTS_FILE_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.num_axes = N;
+        header.coord_type = getTypeTag<C>();
+        header.value_type = getTypeTag<V>();
+        header.num_points = points.size();
+
+        std::size_t offset = 0;
+        auto write = [&file, &offset](const void* data, std::size_t size){
+            file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            offset += size; };
+
+        const char padding[FILE_ALIGNMENT]{};
+        auto align = [&write, &offset, &padding](){
+            write(padding, alignFileOffset(offset) - offset); };
+
+        write(&header, sizeof(header));
+        align();
+
+        // Столбцы пишутся частями через небольшой буфер
+        constexpr std::size_t BUFFER_SIZE = 4096UL;
+        auto writeColumn = [&](auto getField){
+            using Field = decltype(getField(points[0]));
+            Field buffer[BUFFER_SIZE];
+
+            align();
+            for (std::size_t first = 0; first < points.size(); first += BUFFER_SIZE)
+            {
+                const std::size_t count = std::min(BUFFER_SIZE, points.size() - first);
+                for (std::size_t i = 0; i < count; ++i)
+                    buffer[i] = getField(points[first + i]);
+
+                write(buffer, count * sizeof(Field));
+            } };
+
+        if (!points.empty())
+        {
+            for (std::size_t i = 0; i < N; ++i)
+                writeColumn([i](const Point<C, V, N>& point){ return point.getCoord(i); });
+
+            writeColumn([](const Point<C, V, N>& point){ return point.getValue(); });
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+
+        return false;
+    }
+
+    file.close();
+
+    return !file.fail();
+}
+
+// Преобразует файл точек (JSON или двоичный) в двоичный
+template<class C, class V, std::size_t N>
+bool convertPoints(const std::string& input_fn,
+                   const std::string& output_fn,
+                   const std::array<const char*, N>& axis_names,
+                   const char* value_name)
+{
+    const auto points = readPoints<C, V, N>(input_fn, axis_names, value_name);
+    if (points.empty())
+        return false;
+
+    return writeBinaryPoints(output_fn, points);
+}
+
+
+template<class C, class V, std::size_t N>
+PointsSaxReader<C, V, N>::PointsSaxReader(std::vector<Point<C, V, N>>& points,
+                                          const std::array<const char*, N>& axis_names,
+                                          const char* value_name)
+    : points_(points)
+    , axis_names_(axis_names)
+    , value_name_(value_name)
+{
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::null()
+{
+    return setOther();
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::boolean(bool)
+{
+    return setOther();
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::number_integer(json::number_integer_t number)
+{
+    return setNumber(number);
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::number_unsigned(json::number_unsigned_t number)
+{
+    return setNumber(number);
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::number_float(json::number_float_t number,
+                                            const json::string_t&)
+{
+    return setNumber(number);
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::string(json::string_t&)
+{
+    return setOther();
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::binary(json::binary_t&)
+{
+    return setOther();
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::start_object(std::size_t)
+{
+    if (depth_ == 1)
+    {
+        ++num_objects_;
+        field_ = OTHER_FIELD;
+        num_keys_ = 0;
+        keys_.fill(false);
+        found_.fill(false);
+        value_ = V{};
+    }
+    else if (!setOther())
+        return false;
+
+    ++depth_;
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::key(json::string_t& key)
+{
+    if (depth_ != 2)
+        return true;
+
+    field_ = OTHER_FIELD;
+    if (key == value_name_)
+        field_ = VALUE_FIELD;
+
+    for (std::size_t i = 0; i < N; ++i)
+        if (key == axis_names_[i])
+        {
+            field_ = i;
+
+            break;
+        }
+
+    if (field_ == OTHER_FIELD || !keys_[field_])
+        ++num_keys_;
+    if (field_ != OTHER_FIELD)
+        keys_[field_] = true;
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::end_object()
+{
+    if (--depth_ != 1)
+        return true;
+
+    if (num_keys_ < N)
+        return fail("The array is invalid!");
+
+    if (std::find(found_.begin(), found_.end(), false) != found_.end())
+        return fail("The coordinate is missing!");
+
+    points_.emplace_back(coords_, value_);
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::start_array(std::size_t)
+{
+    if (depth_ != 0 && !setOther())
+        return false;
+
+    ++depth_;
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::end_array()
+{
+    if (--depth_ == 0 && num_objects_ == 0)
+        return fail("The file is ill-formed!");
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::parse_error(std::size_t,
+                                           const std::string&,
+                                           const json::exception& e)
+{
+    error_ = e.what();
+
+    return false;
+}
+
+template<class C, class V, std::size_t N>
+const std::string& PointsSaxReader<C, V, N>::getError() const noexcept
+{
+    return error_;
+}
+
+template<class C, class V, std::size_t N>
+template<class T>
+bool PointsSaxReader<C, V, N>::setNumber(T number)
+{
+    if (depth_ != 2)
+        return setOther();
+
+    if (field_ < N)
+    {
+        coords_[field_] = static_cast<C>(number);
+        found_[field_] = true;
+    }
+    else if (field_ == VALUE_FIELD)
+        value_ = static_cast<V>(number);
+
+    return true;
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::setOther()
+{
+    switch (depth_)
+    {
+    case 0:
+        return fail("The file is ill-formed!");
+    case 1:
+        return fail("The array is invalid!");
+    case 2:
+        // Нечисловая координата - ошибка, но о ней, как и при разборе в
+        // DOM, сообщается, только если в объекте достаточно полей
+        if (field_ < N)
+            found_[field_] = false;
+        // Нечисловое значение точки - ноль, как и отсутствующее
+        else if (field_ == VALUE_FIELD)
+            value_ = V{};
+        return true;
+    default:
+        return true;
+    }
+}
+
+template<class C, class V, std::size_t N>
+bool PointsSaxReader<C, V, N>::fail(const char* error)
+{
+    error_ = error;
+
+    return false;
+}
+
+
+template<class C, class V, std::size_t N>
+JsonPointsWriter<C, V, N>::JsonPointsWriter(const std::string& filename,
+                                            int json_indent,
+                                            const std::array<const char*, N>& axis_names,
+                                            const char* value_name)
+    : file_(filename, std::ios::binary)
+    , json_indent_(json_indent)
+{
+    for (std::size_t i = 0; i < N; ++i)
+        fields_[i] = {nlohmann::json(axis_names[i]).dump(), i};
+    fields_[N] = {nlohmann::json(value_name).dump(), N};
+
+    std::sort(fields_.begin(), fields_.end());
+
+    buffer_.reserve(BUFFER_SIZE + 256);
+}
+
+template<class C, class V, std::size_t N>
+JsonPointsWriter<C, V, N>::~JsonPointsWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+    }
+}
+
+template<class C, class V, std::size_t N>
+bool JsonPointsWriter<C, V, N>::isOpen() const noexcept
+{
+    return file_.is_open();
+}
+
+template<class C, class V, std::size_t N>
+void JsonPointsWriter<C, V, N>::write(const Point<C, V, N>& point)
+{
+    const bool pretty = json_indent_ >= 0;
+
+    buffer_ += num_points_++ == 0 ? "[" : ",";
+    if (pretty)
+    {
+        buffer_ += '\n';
+        writeIndent(1);
+    }
+
+    buffer_ += '{';
+    for (std::size_t j = 0; j < fields_.size(); ++j)
+    {
+        if (j != 0)
+            buffer_ += ',';
+
+        if (pretty)
+        {
+            buffer_ += '\n';
+            writeIndent(2);
+        }
+
+        buffer_ += fields_[j].first;
+        buffer_ += pretty ? ": " : ":";
+
+        if (const std::size_t axis = fields_[j].second; axis < N)
+            writeNumber(point.getCoord(axis));
+        else
+            writeNumber(point.getValue());
+    }
+
+    if (pretty)
+    {
+        buffer_ += '\n';
+        writeIndent(1);
+    }
+
+    buffer_ += '}';
+
+    if (buffer_.size() >= BUFFER_SIZE)
+        flush();
+}
+
+template<class C, class V, std::size_t N>
+bool JsonPointsWriter<C, V, N>::close()
+{
+    if (!file_.is_open())
+        return false;
+
+    if (num_points_ == 0)
+        buffer_ += "[]";
+    else
+        buffer_ += json_indent_ >= 0 ? "\n]" : "]";
+
+    flush();
+    file_.close();
+
+    return !file_.fail();
+}
+
+template<class C, class V, std::size_t N>
+template<class T>
+void JsonPointsWriter<C, V, N>::writeNumber(T number)
+{
+    char chars[64];
+
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        // Как и nlohmann::json: не число и бесконечность - null,
+        // а у целого числа с плавающей точкой есть дробная часть
+        if (!isFiniteNumber(number))
+        {
+            buffer_ += "null";
+
+            return;
+        }
+
+        const auto last = std::to_chars(chars, chars + sizeof(chars), number).ptr;
+        buffer_.append(chars, last);
+
+        if (std::find_if(chars, last, [](char c){ return c == '.' || c == 'e'; }) == last)
+            buffer_ += ".0";
+    }
+    else
+        buffer_.append(chars, std::to_chars(chars, chars + sizeof(chars), number).ptr);
+}
+
+template<class C, class V, std::size_t N>
+void JsonPointsWriter<C, V, N>::writeIndent(std::size_t depth)
+{
+    buffer_.append(depth * static_cast<std::size_t>(json_indent_), ' ');
+}
+
+template<class C, class V, std::size_t N>
+void JsonPointsWriter<C, V, N>::flush()
+{
+    file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
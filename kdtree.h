@@ -2,10 +2,16 @@
 
 #include <cmath>
 
-#include <queue>
+#include <bit>
+#include <span>
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <future>
 #include <utility>
+#include <iterator>
+#include <concepts>
 #include <type_traits>
 
 #include <algorithm>
@@ -15,6 +21,8 @@
 #include <exception>
 
 #include "utils.h"
+#include "bounded_heap.h"
+#include "idw_kernels.h"
 
 template<class>
 class KdTree;
@@ -59,6 +67,9 @@ class KdTree final
         static auto getDistance(const Item& item, const Node* node)
         noexcept(noexcept(std::declval<Item>().getDistance(std::declval<Item>())));
 
+        static auto getSquaredDistance(const Item& item, const Node* node)
+        noexcept(noexcept(std::declval<Item>().getSquaredDistance(std::declval<Item>())));
+
         static bool compareEqual(const Item& item,
                                  const std::shared_ptr<Node>& node) noexcept;
 
@@ -74,10 +85,17 @@ class KdTree final
 
         bool isLeaf() const noexcept;
 
+        bool isUnbalanced() const noexcept;
+
         Item item;
         const std::size_t dimension;
         std::shared_ptr<Node> left;
         std::shared_ptr<Node> right;
+        // Число узлов в поддереве, включая этот и удалённые
+        std::size_t size;
+        // Удалённый узел остаётся в дереве до уплотнения, но при поиске
+        // его точка пропускается, а плоскость разбиения используется
+        bool is_deleted = false;
     };
 
     // Nearest Neighbors Search
@@ -88,11 +106,11 @@ class KdTree final
         // повышения эффективности работы с контейнерами STL.
         static_assert(std::is_trivially_destructible_v<Item>);
 
-        using Pair = std::pair<decltype(std::declval<Item>().getDistance(std::declval<Item>())),
+        // Соседи упорядочиваются по квадратам расстояний, а корень
+        // извлекается только при вычислении весов интерполяции
+        using Pair = std::pair<decltype(std::declval<Item>().getSquaredDistance(std::declval<Item>())),
                                const Item*>;
 
-        using Container = std::vector<Pair>;
-
         struct CompareLess
         {
             bool operator()(const Pair& lhs,
@@ -102,30 +120,104 @@ class KdTree final
             }
         };
 
-        using PriorityQueue = std::priority_queue<Pair, Container, CompareLess>;
+        // Для небольшого числа соседей куча целиком на стеке
+        using Heap = BoundedHeap<Pair, 32, CompareLess>;
+
+        // Отложенная при обходе ветвь: поддерево aux и квадрат расстояния
+        // от искомой точки до плоскости разбиения его родителя node, т.е.
+        // нижняя граница квадратов расстояний до точек поддерева. При
+        // обратном поиске сам node к этому моменту ещё не просмотрен.
+        struct Branch
+        {
+            const Node* node;
+            const Node* aux;
+            typename Pair::first_type distance;
+        };
+
+        // Обход без рекурсии: отложенные ветви хранятся в явном стеке,
+        // глубина которого не ограничена стеком вызовов потока
+        using Stack = std::vector<Branch>;
 
         NnsSessProps(const Item& item,
-                     std::size_t num_neighbors);
+                     std::size_t num_neighbors,
+                     double approx_epsilon,
+                     Heap& heap,
+                     Stack& stack);
 
         NnsSessProps(const NnsSessProps&) = delete;
         NnsSessProps& operator=(const NnsSessProps&) = delete;
 
-        auto makeQueue();
-
         void updateQueue(const Node* node);
 
-        bool isAuxRequired(const Node* node) const;
+        bool isAuxRequired(typename Pair::first_type distance) const;
 
         const Item& item;
-        const std::size_t num_neighbors;
-        PriorityQueue neighbors;
+        // Куча и стек из рабочего пространства запроса (см. QueryWorkspace)
+        Heap& neighbors;
+        Stack& branches;
+        // Поддерево просматривается, только если расстояние до плоскости
+        // разбиения, умноженное на (1 + ε), меньше расстояния до самого
+        // дальнего из найденных соседей. При ε = 0 поиск точный, иначе
+        // каждый найденный сосед не более чем в (1 + ε) раз дальше, чем
+        // настоящий сосед с тем же номером, зато узлов просматривается
+        // намного меньше, особенно при большом числе соседей. Хранится
+        // квадрат множителя, так как сравниваются квадраты расстояний.
+        double prune_factor;
     };
 
 public:
+    using Distance = decltype(std::declval<Item>().getDistance(std::declval<Item>()));
+
+    using SquaredDistance = decltype(std::declval<Item>().getSquaredDistance(std::declval<Item>()));
+
+    using Value = std::decay_t<decltype(std::declval<Item>().getValue())>;
+
+    // Рабочее пространство запросов поиска соседей: куча соседей и стек
+    // обхода, память которых сохраняется между запросами. Его создаёт
+    // вызывающий и передаёт во все свои запросы (одно пространство - один
+    // поток), и тогда после запроса с наибольшим числом соседей память
+    // больше не выделяется.
+    // Запросы без него создают временное пространство на каждый вызов.
+    class QueryWorkspace final
+    {
+        friend class KdTree;
+
+        typename NnsSessProps::Heap neighbors;
+        typename NnsSessProps::Stack branches;
+    };
+
+    // Поддеревья меньшего размера всегда строятся в одном потоке
+    static constexpr std::size_t PARALLEL_BUILD_CUTOFF = 1UL << 14;
+
+    // Дерево перестраивается частично, как "дерево козла отпущения"
+    // (scapegoat tree): если после вставки в каком-либо поддереве на пути
+    // от корня одно из дочерних поддеревьев содержит больше этой доли его
+    // узлов, то самое верхнее такое поддерево строится заново по медианам.
+    // Высота дерева остаётся логарифмической, а амортизированная стоимость
+    // вставки - O(log^2 n). Удаление структуру дерева не меняет.
+    static constexpr double BALANCE_FACTOR = 0.7;
+
+    // При пакетной вставке поддерево перестраивается целиком, если число
+    // попавших в него точек пакета не меньше его размера, умноженного на
+    // этот множитель, а иначе пакет делится между его поддеревьями.
+    // Пакетное удаление так же сравнивает пакет со всем деревом.
+    static constexpr double BATCH_REBUILD_FACTOR = 1.0;
+
+    // Удаление только помечает узел, и когда доля таких узлов превысит порог,
+    // дерево уплотняется - строится заново из оставшихся точек. Порог не
+    // меньше 1 отключает уплотнение, и тогда его выполняет только compact().
+    static constexpr double COMPACTION_THRESHOLD = 0.25;
+
     KdTree() = default;
 
-    KdTree(std::vector<Item>&& items) noexcept;
+    // num_threads = 0 - по числу аппаратных потоков
+    KdTree(std::vector<Item>&& items,
+           std::size_t num_threads = 1) noexcept;
 
+    // Копия - это снимок за O(1): версии дерева делят между собой узлы, а
+    // изменяемый узел копируется вместе с путём к нему от корня, если на
+    // него ссылается другая версия (path copying). Поэтому одну версию
+    // можно изменять, пока другие без блокировок читаются в других потоках.
     KdTree(const KdTree&) noexcept;
     KdTree(KdTree&&) noexcept;
     
@@ -134,7 +226,10 @@ public:
 
     bool isEmpty() const noexcept;
 
-    bool isBusy() const noexcept;
+    // Число точек без учёта удалённых
+    std::size_t getSize() const noexcept;
+
+    std::size_t getHeight() const noexcept;
 
     bool insert(Item&& item
 #ifndef ALLOW_DUPLICATE_POINTS
@@ -144,55 +239,210 @@ public:
 
     bool remove(const Item& item) noexcept;
 
+    // Пакетная вставка делит пакет плоскостями разбиения при одном спуске в
+    // каждое поддерево, а поддеревья, небольшие по сравнению с попавшей в них
+    // частью пакета, перестраиваются вместе с ней. Пакетное удаление строит
+    // дерево заново без точек пакета, если пакет не меньше дерева, а иначе
+    // удаляет точки по одной. Точки, совпадающие между собой или с уже
+    // имеющимися, обрабатываются так же, как при вставке и удалении по одной.
+    // Возвращается число вставленных и удалённых точек соответственно.
+    std::size_t insert(std::vector<Item>&& items
+#ifndef ALLOW_DUPLICATE_POINTS
+                       , bool update = false
+#endif
+                       ) noexcept;
+
+    std::size_t remove(std::span<const Item> items) noexcept;
+
+    void setCompactionThreshold(double compaction_threshold) noexcept;
+
+    bool compact() noexcept;
+
+    // approx_epsilon > 0 - приближённый поиск (см. NnsSessProps)
     std::vector<Item> neighborsSearch(const Item& item,
                                       std::size_t num_neighbors,
-                                      bool reverse_search) const;
+                                      bool reverse_search,
+                                      double approx_epsilon = 0.0) const;
+
+    // Тот же поиск без вектора результата: visitor(квадрат расстояния,
+    // указатель на точку) вызывается для каждого соседа от ближнего к
+    // дальнему, а возвращается число соседей. Указатели действительны
+    // до первого изменения дерева.
+    template<class Visitor>
+    requires std::invocable<Visitor&, SquaredDistance, const Item*>
+    std::size_t visitNeighbors(const Item& item,
+                               std::size_t num_neighbors,
+                               bool reverse_search,
+                               Visitor&& visitor,
+                               double approx_epsilon = 0.0) const;
+
+    template<class Visitor>
+    requires std::invocable<Visitor&, SquaredDistance, const Item*>
+    std::size_t visitNeighbors(QueryWorkspace& workspace,
+                               const Item& item,
+                               std::size_t num_neighbors,
+                               bool reverse_search,
+                               Visitor&& visitor,
+                               double approx_epsilon = 0.0) const;
 
     std::vector<Item> shepardInterpolation(Item& item,
                                            std::size_t num_neighbors,
                                            bool reverse_search,
-                                           double idw_power) const;
+                                           double idw_power,
+                                           double approx_epsilon = 0.0) const;
+
+    // Только значение в точке item, без копирования соседей. Если задан
+    // neighbors, то в него копируются соседи, по которым вычислено
+    // значение (для отладки). Если соседей нет, то значение самой item.
+    Value interpolate(const Item& item,
+                      std::size_t num_neighbors,
+                      bool reverse_search,
+                      double idw_power,
+                      double approx_epsilon = 0.0,
+                      std::vector<Item>* neighbors = nullptr) const;
+
+    Value interpolate(QueryWorkspace& workspace,
+                      const Item& item,
+                      std::size_t num_neighbors,
+                      bool reverse_search,
+                      double idw_power,
+                      double approx_epsilon = 0.0,
+                      std::vector<Item>* neighbors = nullptr) const;
+
+    // Поиск "сначала лучший" (best-bin-first): вместо обхода в глубину
+    // отложенные ветви хранятся в куче и просматриваются в порядке
+    // расстояния до их области, а max_checks ограничивает число вычислений
+    // расстояний до точек (0 - без ограничения). exact = false, если
+    // бюджет исчерпан раньше, чем доказано, что ближе соседей нет.
+    std::vector<Item> bestBinFirstSearch(const Item& item,
+                                         std::size_t num_neighbors,
+                                         std::size_t max_checks,
+                                         bool& exact) const;
+
+    // Все точки на расстоянии не больше radius от item в порядке обхода
+    // дерева. Буфер neighbors очищается, но его ёмкость сохраняется, так
+    // что при повторных запросах с тем же буфером память не выделяется.
+    // Указатели действительны до первого изменения дерева.
+    std::size_t radiusSearch(const Item& item,
+                             Distance radius,
+                             std::vector<const Item*>& neighbors) const;
+
+    // Только количество таких точек, без их сохранения
+    std::size_t rangeCount(const Item& item,
+                           Distance radius) const;
 
 private:
-    std::shared_ptr<Node> buildTree(std::vector<Item>&& items,
-                                    std::size_t depth) const;
+    using Iterator = typename std::vector<Item>::iterator;
+
+    std::shared_ptr<Node> buildTree(Iterator first,
+                                    Iterator last,
+                                    std::size_t depth,
+                                    std::size_t num_threads) const;
 
-    std::shared_ptr<Node> copyTree(const std::shared_ptr<Node>& node) const noexcept;
+    // Узел, который можно изменять: если на него ссылается ещё и другая
+    // версия дерева, то в этой он заменяется копией. Все его предки уже
+    // должны быть отделены, иначе копия окажется и в другой версии.
+    static Node& detach(std::shared_ptr<Node>& node);
 
     void printTree(std::ostream& out,
                    const std::shared_ptr<Node>& node,
                    std::size_t depth) const;
 
-    bool insertItem(std::shared_ptr<Node>& node,
+    std::size_t getHeight(const Node* node) const noexcept;
+
+    // Только неудалённые точки
+    void collectItems(const std::shared_ptr<Node>& node,
+                      std::vector<Item>& items) const;
+
+    void rebuildTree(std::shared_ptr<Node>& node);
+
+    // Учитывает удалённые узлы, выброшенные при перестроении поддерева
+    void dropDeleted(std::size_t size,
+                     std::size_t num_items) noexcept;
+
+    void compactIfRequired();
+
+    // Неудалённая точка, совпадающая с item по всем осям. Ищется в обоих
+    // поддеревьях, если равна узлу по оси разбиения: после перестроения по
+    // медиане такие точки бывают слева, хотя новые вставляются справа.
+    const Node* findItem(const std::shared_ptr<Node>& node,
+                         const Item& item) const;
+
+    // Звено пути от корня к узлу. Звенья лежат в кадрах рекурсии поиска,
+    // поэтому путь к найденному узлу не требует отдельной памяти.
+    struct PathLink
+    {
+        const Node* node;
+        const PathLink* parent;
+    };
+
+    // Отделяет узлы пути от корня до узла link включительно
+    Node& detachPath(const PathLink* link);
+
+    // Узел неудалённой точки, совпадающей с item, который ищется так же, как
+    // в findItem(), начиная с корня (parent - путь к node). Путь к узлу
+    // отделяется только после того, как точка найдена, поэтому поиск
+    // отсутствующей точки ничего не копирует.
+    Node* detachItem(const std::shared_ptr<Node>& node,
+                     const Item& item,
+                     const PathLink* parent = nullptr);
+
+#ifndef ALLOW_DUPLICATE_POINTS
+    static Iterator uniqueItems(Iterator first,
+                                Iterator last,
+                                bool update);
+#endif
+
+    // Совпадения отсеяны заранее, поэтому размер каждого узла на пути
+    // меняется. scapegoat - самое верхнее несбалансированное поддерево.
+    void insertItem(std::shared_ptr<Node>& node,
                     Item&& item,
-                    std::size_t depth
+                    std::size_t depth,
+                    std::shared_ptr<Node>*& scapegoat);
+
+    // Точек пакета в дереве нет, кроме случая, когда поддерево
+    // перестраивается вместе с пакетом и сверяется с ним само
+    std::size_t insertItems(std::shared_ptr<Node>& node,
+                            Iterator first,
+                            Iterator last,
+                            std::size_t depth
 #ifndef ALLOW_DUPLICATE_POINTS
-                    , bool update = false
+                            , bool update
 #endif
-                    );
+                            );
+
+    void search(NnsSessProps& session,
+                bool reverse_search) const;
 
-    void getMinItem(const std::shared_ptr<Node>& node,
-                    const Item*& min_item,
-                    std::size_t dimension) const;
+    void forwardSearch(NnsSessProps& session) const;
 
-    bool removeItem(std::shared_ptr<Node>& node,
-                    const Item& item);
+    void reverseSearch(NnsSessProps& session) const;
 
-    void forwardSearch(const Node* node) const;
+    bool bestBinFirstSearch(NnsSessProps& session,
+                            std::size_t max_checks) const;
 
-    void reverseSearch(const Node* node) const;
+    template<class Visitor>
+    void rangeSearch(const Node* node,
+                     const Item& item,
+                     Distance radius,
+                     Visitor& visitor) const;
 
     std::shared_ptr<Node> root_;
-    mutable std::unique_ptr<NnsSessProps> search_session_;
+    std::size_t num_deleted_ = 0;
+    double compaction_threshold_ = COMPACTION_THRESHOLD;
 };
 
 
 template<class Item>
-KdTree<Item>::KdTree(std::vector<Item>&& items) noexcept
+KdTree<Item>::KdTree(std::vector<Item>&& items,
+                     std::size_t num_threads) noexcept
 {
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
     try
     {
-        root_ = buildTree(std::move(items), 0);
+        root_ = buildTree(items.begin(), items.end(), 0, num_threads);
     }
     catch (const std::exception& e)
     {
@@ -202,23 +452,26 @@ KdTree<Item>::KdTree(std::vector<Item>&& items) noexcept
 
 template<class Item>
 KdTree<Item>::KdTree(const KdTree& tree) noexcept
-    : root_(copyTree(tree.root_))
+    : root_(tree.root_)
+    , num_deleted_(tree.num_deleted_)
+    , compaction_threshold_(tree.compaction_threshold_)
 {
 }
 
 template<class Item>
 KdTree<Item>::KdTree(KdTree&& tree) noexcept
+    : root_(std::move(tree.root_))
+    , num_deleted_(std::exchange(tree.num_deleted_, 0))
+    , compaction_threshold_(tree.compaction_threshold_)
 {
-    if (tree.search_session_)
-        root_ = copyTree(tree.root_);
-    else
-        root_ = std::move(tree.root_);
 }
 
 template<class Item>
 KdTree<Item>& KdTree<Item>::operator=(const KdTree& tree) noexcept
 {
-    root_ = copyTree(tree.root_);
+    root_ = tree.root_;
+    num_deleted_ = tree.num_deleted_;
+    compaction_threshold_ = tree.compaction_threshold_;
 
     return *this;
 }
@@ -226,10 +479,9 @@ KdTree<Item>& KdTree<Item>::operator=(const KdTree& tree) noexcept
 template<class Item>
 KdTree<Item>& KdTree<Item>::operator=(KdTree&& tree) noexcept
 {
-    if (tree.search_session_)
-        root_ = copyTree(tree.root_);
-    else
-        root_ = std::move(tree.root_);
+    root_ = std::move(tree.root_);
+    num_deleted_ = std::exchange(tree.num_deleted_, 0);
+    compaction_threshold_ = tree.compaction_threshold_;
 
     return *this;
 }
@@ -237,13 +489,19 @@ KdTree<Item>& KdTree<Item>::operator=(KdTree&& tree) noexcept
 template<class Item>
 bool KdTree<Item>::isEmpty() const noexcept
 {
-    return !root_;
+    return getSize() == 0;
 }
 
 template<class Item>
-bool KdTree<Item>::isBusy() const noexcept
+std::size_t KdTree<Item>::getSize() const noexcept
 {
-    return !!search_session_;
+    return root_ ? root_->size - num_deleted_ : 0;
+}
+
+template<class Item>
+std::size_t KdTree<Item>::getHeight() const noexcept
+{
+    return getHeight(root_.get());
 }
 
 template<class Item>
@@ -254,16 +512,41 @@ bool KdTree<Item>::insert(Item&& item
                           ) noexcept
 try
 {
-    if (search_session_)
-        return false;
-
-    return insertItem(root_,
-                      std::move(item),
-                      0
 #ifndef ALLOW_DUPLICATE_POINTS
-                      , update
+    // Совпадающая точка ищется до спуска, чтобы отклонённая
+    // вставка не копировала путь, общий с другими версиями
+    if (update)
+    {
+        if (auto* node = detachItem(root_, item))
+        {
+            node->setValue(item);
+
+            return false;
+        }
+    }
+    else if (findItem(root_, item))
+        return false;
 #endif
-                      );
+
+    const Item key = item;
+
+    std::shared_ptr<Node>* scapegoat = nullptr;
+    insertItem(root_, std::move(item), 0, scapegoat);
+
+    if (scapegoat)
+    {
+        // Удалённые узлы перестроенного поддерева исчезают, поэтому размеры
+        // его предков уменьшаются. Предки не изменились, и путь к нему от
+        // корня тот же, что и у вставленной точки.
+        const std::size_t num_deleted = num_deleted_;
+        rebuildTree(*scapegoat);
+
+        for (auto* link = &root_; link != scapegoat;
+             link = Node::compareLess(key, *link) ? &(*link)->left : &(*link)->right)
+            (*link)->size -= num_deleted - num_deleted_;
+    }
+
+    return true;
 }
 catch (const std::exception& e)
 {
@@ -276,11 +559,139 @@ template<class Item>
 bool KdTree<Item>::remove(const Item& item) noexcept
 try
 {
-    if (not root_
-        or search_session_)
+    // Узел только помечается, поэтому удаление стоит столько же, сколько
+    // поиск точки, а перестроение откладывается до уплотнения всего дерева
+    auto* node = detachItem(root_, item);
+    if (!node)
         return false;
 
-    return removeItem(root_, item);
+    node->is_deleted = true;
+    ++num_deleted_;
+
+    compactIfRequired();
+
+    return true;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << std::endl;
+
+    return false;
+}
+
+template<class Item>
+std::size_t KdTree<Item>::insert(std::vector<Item>&& items
+#ifndef ALLOW_DUPLICATE_POINTS
+                                 , bool update
+#endif
+                                 ) noexcept
+try
+{
+#ifndef ALLOW_DUPLICATE_POINTS
+    // Совпадающие точки пакета заранее сводятся к одной,
+    // поэтому дальше порядок точек в пакете уже не важен
+    items.erase(uniqueItems(items.begin(), items.end(), update), items.end());
+
+    // Как и при вставке по одной, совпадения с имеющимися точками
+    // ищутся до спуска, кроме пакета, перестраивающего всё дерево
+    if (root_ && items.size() < BATCH_REBUILD_FACTOR * root_->size)
+        items.erase(std::remove_if(items.begin(), items.end(), [this, update](const Item& item){
+                        if (!update)
+                            return findItem(root_, item) != nullptr;
+
+                        auto* node = detachItem(root_, item);
+                        if (node)
+                            node->setValue(item);
+
+                        return node != nullptr; }),
+                    items.end());
+#endif
+
+    return insertItems(root_,
+                       items.begin(),
+                       items.end(),
+                       0
+#ifndef ALLOW_DUPLICATE_POINTS
+                       , update
+#endif
+                       );
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << std::endl;
+
+    return 0;
+}
+
+template<class Item>
+std::size_t KdTree<Item>::remove(std::span<const Item> items) noexcept
+try
+{
+    if (!root_)
+        return 0;
+
+    std::size_t num_removed = 0;
+    if (items.size() >= BATCH_REBUILD_FACTOR * root_->size)
+    {
+        // Разность мультимножеств: каждая точка пакета
+        // удаляет не больше одной совпадающей с ней
+        auto compareLess = [](const Item& lhs, const Item& rhs){
+            return lhs.compareLess(rhs); };
+
+        std::vector<Item> existing;
+        existing.reserve(root_->size);
+        collectItems(root_, existing);
+        dropDeleted(root_->size, existing.size());
+
+        std::vector<Item> batch(items.begin(), items.end());
+        std::sort(existing.begin(), existing.end(), compareLess);
+        std::sort(batch.begin(), batch.end(), compareLess);
+
+        std::vector<Item> kept;
+        std::set_difference(existing.begin(), existing.end(), batch.begin(), batch.end(),
+                            std::back_inserter(kept), compareLess);
+
+        num_removed = existing.size() - kept.size();
+        root_ = buildTree(kept.begin(), kept.end(), root_->dimension, 1);
+    }
+    else
+    {
+        // Пометка по одной точке копирует, если дерево общее с другой
+        // версией, только пути к найденным узлам
+        for (const auto& item : items)
+            if (auto* node = detachItem(root_, item))
+            {
+                node->is_deleted = true;
+                ++num_deleted_;
+                ++num_removed;
+            }
+    }
+
+    compactIfRequired();
+
+    return num_removed;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << std::endl;
+
+    return 0;
+}
+
+template<class Item>
+void KdTree<Item>::setCompactionThreshold(double compaction_threshold) noexcept
+{
+    compaction_threshold_ = compaction_threshold;
+}
+
+template<class Item>
+bool KdTree<Item>::compact() noexcept
+try
+{
+    if (root_ && num_deleted_ != 0)
+        rebuildTree(root_);
+
+    return true;
 }
 catch (const std::exception& e)
 {
@@ -292,147 +703,316 @@ catch (const std::exception& e)
 template<class Item>
 std::vector<Item> KdTree<Item>::neighborsSearch(const Item& item,
                                                 std::size_t num_neighbors,
-                                                bool reverse_search) const
+                                                bool reverse_search,
+                                                double approx_epsilon) const
+{
+    std::vector<Item> out;
+    out.reserve(std::min(num_neighbors, getSize()));
+
+    visitNeighbors(item,
+                   num_neighbors,
+                   reverse_search,
+                   [&out](SquaredDistance, const Item* neighbor){ out.push_back(*neighbor); },
+                   approx_epsilon);
+
+    return out;
+}
+
+template<class Item>
+template<class Visitor>
+requires std::invocable<Visitor&, typename KdTree<Item>::SquaredDistance, const Item*>
+std::size_t KdTree<Item>::visitNeighbors(const Item& item,
+                                         std::size_t num_neighbors,
+                                         bool reverse_search,
+                                         Visitor&& visitor,
+                                         double approx_epsilon) const
+{
+    QueryWorkspace workspace;
+
+    return visitNeighbors(workspace,
+                          item,
+                          num_neighbors,
+                          reverse_search,
+                          std::forward<Visitor>(visitor),
+                          approx_epsilon);
+}
+
+template<class Item>
+template<class Visitor>
+requires std::invocable<Visitor&, typename KdTree<Item>::SquaredDistance, const Item*>
+std::size_t KdTree<Item>::visitNeighbors(QueryWorkspace& workspace,
+                                         const Item& item,
+                                         std::size_t num_neighbors,
+                                         bool reverse_search,
+                                         Visitor&& visitor,
+                                         double approx_epsilon) const
 {
     if (not root_
-        or search_session_
         or num_neighbors == 0)
-        return {};
+        return 0;
 
-    search_session_ = std::make_unique<NnsSessProps>(item, num_neighbors);
+    // Данные сессии поиска принадлежат вызывающему потоку, а дерево
+    // только читается, поэтому запросы к нему могут быть параллельными.
+    NnsSessProps session{item, num_neighbors, approx_epsilon, workspace.neighbors, workspace.branches};
 
     try
     {
-        if (reverse_search)
-            reverseSearch(root_.get());
-        else
-            forwardSearch(root_.get());
+        search(session, reverse_search);
     }
     catch (const std::exception& e)
     {
         std::cout << e.what() << std::endl;
 
-        search_session_.reset();
-
-        return {};
+        return 0;
     }
 
-    auto& neighbors = search_session_->neighbors;
+    auto& neighbors = session.neighbors;
+    neighbors.sort();
 
-    std::vector<Item> out;
-    out.reserve(neighbors.size());
-    while (!neighbors.empty())
-    {
-        out.push_back(*neighbors.top().second);
-        neighbors.pop();
-    }
-
-    search_session_.reset();
+    for (const auto& neighbor : neighbors)
+        visitor(neighbor.first, neighbor.second);
 
-    return out;
+    return neighbors.size();
 }
 
 template<class Item>
 std::vector<Item> KdTree<Item>::shepardInterpolation(Item& item,
                                                      std::size_t num_neighbors,
                                                      bool reverse_search,
-                                                     double idw_power) const
+                                                     double idw_power,
+                                                     double approx_epsilon) const
+{
+    std::vector<Item> out;
+    item.setValue(interpolate(item,
+                              num_neighbors,
+                              reverse_search,
+                              idw_power,
+                              approx_epsilon,
+                              &out));
+
+    return out;
+}
+
+template<class Item>
+typename KdTree<Item>::Value KdTree<Item>::interpolate(const Item& item,
+                                                       std::size_t num_neighbors,
+                                                       bool reverse_search,
+                                                       double idw_power,
+                                                       double approx_epsilon,
+                                                       std::vector<Item>* neighbors) const
 {
+    QueryWorkspace workspace;
+
+    return interpolate(workspace,
+                       item,
+                       num_neighbors,
+                       reverse_search,
+                       idw_power,
+                       approx_epsilon,
+                       neighbors);
+}
+
+template<class Item>
+typename KdTree<Item>::Value KdTree<Item>::interpolate(QueryWorkspace& workspace,
+                                                       const Item& item,
+                                                       std::size_t num_neighbors,
+                                                       bool reverse_search,
+                                                       double idw_power,
+                                                       double approx_epsilon,
+                                                       std::vector<Item>* neighbors) const
+{
+    if (neighbors)
+        neighbors->clear();
+
+    // Соседи упорядочены от ближнего к дальнему, поэтому совпадающая
+    // с искомой точка, если она есть, будет обработана самой первой.
+    // Вес вычисляется прямо из квадрата расстояния (см. IdwKernel).
+    IdwAccumulator accumulator{idw_power};
+    [[maybe_unused]] const Item* match = nullptr;
+
+    auto visitor = [&](SquaredDistance distance, const Item* neighbor){
+#ifdef ZERO_DISTANCE_HANDLING
+        if (match)
+            return;
+
+        if (isZeroSquared(distance)) [[unlikely]]
+        {
+            match = neighbor;
+            if (neighbors)
+                neighbors->push_back(*neighbor);
+
+            return;
+        }
+
+        const auto squared_distance = static_cast<double>(distance);
+#else
+        const auto squared_distance = isZeroSquared(distance)
+                                      ? static_cast<double>(EPSILON<Distance> * EPSILON<Distance>)
+                                      : static_cast<double>(distance);
+#endif
+        accumulator.add(squared_distance, static_cast<double>(neighbor->getValue()));
+
+        if (neighbors)
+            neighbors->push_back(*neighbor); };
+
+    if (visitNeighbors(workspace, item, num_neighbors, reverse_search, visitor, approx_epsilon) == 0)
+        return item.getValue();
+
+#ifdef ZERO_DISTANCE_HANDLING
+    if (match)
+        return match->getValue();
+#endif
+
+    return static_cast<Value>(accumulator.getMean());
+}
+
+template<class Item>
+std::vector<Item> KdTree<Item>::bestBinFirstSearch(const Item& item,
+                                                   std::size_t num_neighbors,
+                                                   std::size_t max_checks,
+                                                   bool& exact) const
+{
+    exact = true;
+
     if (not root_
-        or search_session_
         or num_neighbors == 0)
         return {};
 
-    search_session_ = std::make_unique<NnsSessProps>(item, num_neighbors);
+    QueryWorkspace workspace;
+    NnsSessProps session{item, num_neighbors, 0.0, workspace.neighbors, workspace.branches};
 
     try
     {
-        if (reverse_search)
-            reverseSearch(root_.get());
-        else
-            forwardSearch(root_.get());
+        exact = bestBinFirstSearch(session, max_checks);
     }
     catch (const std::exception& e)
     {
         std::cout << e.what() << std::endl;
 
-        search_session_.reset();
+        exact = false;
 
         return {};
     }
 
-    auto& neighbors = search_session_->neighbors;
+    auto& neighbors = session.neighbors;
+    neighbors.sort();
 
     std::vector<Item> out;
     out.reserve(neighbors.size());
+    for (const auto& neighbor : neighbors)
+        out.push_back(*neighbor.second);
 
-    long double num = 0.0L, den = 0.0L;
-    while (!neighbors.empty())
-    {
-        const auto& neighbor = neighbors.top();
+    return out;
+}
 
-#ifdef ZERO_DISTANCE_HANDLING
-        if (isZero(neighbor.first)) [[unlikely]]
-        {
-            out.clear();
-            out.push_back(*neighbor.second);
+template<class Item>
+std::size_t KdTree<Item>::radiusSearch(const Item& item,
+                                       Distance radius,
+                                       std::vector<const Item*>& neighbors) const
+{
+    neighbors.clear();
+
+    if (!root_)
+        return 0;
+
+    try
+    {
+        auto visitor = [&neighbors](const Item* neighbor){ neighbors.push_back(neighbor); };
+        rangeSearch(root_.get(), item, radius, visitor);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
 
-            item.setValue(neighbor.second->getValue());
+        neighbors.clear();
+    }
 
-            search_session_.reset();
+    return neighbors.size();
+}
 
-            return out;
-        }
+template<class Item>
+std::size_t KdTree<Item>::rangeCount(const Item& item,
+                                     Distance radius) const
+{
+    if (!root_)
+        return 0;
 
-        const auto weight = 1.0 / std::pow(neighbor.first, idw_power);
-#else
-        const auto weight = 1.0 / std::pow(isZero(neighbor.first) ? EPSILON<decltype(neighbor.first)>
-                                                                  : neighbor.first,
-                                           idw_power);
-#endif
-        num += weight * neighbor.second->getValue();
-        den += weight;
+    std::size_t count = 0;
 
-        out.push_back(*neighbor.second);
-        neighbors.pop();
+    try
+    {
+        auto visitor = [&count](const Item*){ ++count; };
+        rangeSearch(root_.get(), item, radius, visitor);
     }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
 
-    item.setValue(num / den);
-
-    search_session_.reset();
+        return 0;
+    }
 
-    return out;
+    return count;
 }
 
 template<class Item>
 std::shared_ptr<typename KdTree<Item>::Node>
-KdTree<Item>::buildTree(std::vector<Item>&& items,
-                        std::size_t depth) const
+KdTree<Item>::buildTree(Iterator first,
+                        Iterator last,
+                        std::size_t depth,
+                        std::size_t num_threads) const
 {
-    if (items.empty())
+    if (first == last)
         return nullptr;
 
-    if (items.size() == 1)
-        return std::make_shared<Node>(std::move(items[0]), depth);
+    if (last - first == 1)
+        return std::make_shared<Node>(std::move(*first), depth);
+
+    // Разбиение выполняется на месте в исходном векторе: std::nth_element()
+    // ставит медиану на своё место за линейное время, а элементы слева и
+    // справа от неё становятся не больше и не меньше её соответственно, т.е.
+    // построение занимает O(n log n) без копирования половин на каждом шаге.
+    const auto median = first + (last - first) / 2;
+    std::nth_element(first, median, last, Node::getComparator(depth));
 
-    std::sort(items.begin(), items.end(), Node::getComparator(depth));
+    std::shared_ptr<Node> left, right;
+    if (num_threads > 1
+        and static_cast<std::size_t>(last - first) >= PARALLEL_BUILD_CUTOFF)
+    {
+        // Поддеревья независимы друг от друга и равны по размеру, поэтому
+        // левое строится в новом потоке, а правое - в текущем, и потоки
+        // делятся между ними поровну. Исключение из нового потока будет
+        // выброшено повторно в этом при вызове get().
+        auto future = std::async(std::launch::async,
+                                 &KdTree::buildTree, this,
+                                 first, median, depth + 1, num_threads / 2);
+
+        right = buildTree(median + 1, last, depth + 1, num_threads - num_threads / 2);
+        left = future.get();
+    }
+    else
+    {
+        left = buildTree(first, median, depth + 1, 1);
+        right = buildTree(median + 1, last, depth + 1, 1);
+    }
 
-    const auto median = items.size() / 2;
-    return std::make_shared<Node>(std::move(items[median]), depth,
-                                  buildTree({items.begin(), items.begin() + median}, depth + 1),
-                                  buildTree({items.begin() + median + 1, items.end()}, depth + 1));
+    return std::make_shared<Node>(std::move(*median), depth,
+                                  std::move(left),
+                                  std::move(right));
 }
 
 template<class Item>
-std::shared_ptr<typename KdTree<Item>::Node>
-KdTree<Item>::copyTree(const std::shared_ptr<Node>& node) const noexcept
+typename KdTree<Item>::Node& KdTree<Item>::detach(std::shared_ptr<Node>& node)
 {
-    if (!node)
-        return nullptr;
+    if (node.use_count() > 1)
+        node = std::make_shared<Node>(node,
+                                      std::shared_ptr<Node>{node->left},
+                                      std::shared_ptr<Node>{node->right});
+    else
+        // Другая версия могла только что отпустить узел в другом потоке, и
+        // её чтение узла должно завершиться раньше его изменения в этом
+        std::atomic_thread_fence(std::memory_order_acquire);
 
-    return std::make_shared<Node>(node,
-                                  copyTree(node->left),
-                                  copyTree(node->right));
+    return *node;
 }
 
 template<class Item>
@@ -443,8 +1023,9 @@ void KdTree<Item>::printTree(std::ostream& out,
     if (node->left)
         printTree(out, node->left, depth + 1);
 
-    out << "\x1b[1;31m" << depth << "\x1b[0m\t"
-        << "\x1b[1;32m" << node->item << "\x1b[0m\n";
+    if (!node->is_deleted)
+        out << "\x1b[1;31m" << depth << "\x1b[0m\t"
+            << "\x1b[1;32m" << node->item << "\x1b[0m\n";
 
     if (node->right)
         printTree(out, node->right, depth + 1);
@@ -463,176 +1044,469 @@ std::ostream& operator<<(std::ostream& out, const KdTree<Item>& tree)
 }
 
 template<class Item>
-bool KdTree<Item>::insertItem(std::shared_ptr<Node>& node,
-                              Item&& item,
-                              std::size_t depth
+std::size_t KdTree<Item>::getHeight(const Node* node) const noexcept
+{
+    if (!node)
+        return 0;
+
+    return 1 + std::max(getHeight(node->left.get()), getHeight(node->right.get()));
+}
+
+template<class Item>
+void KdTree<Item>::collectItems(const std::shared_ptr<Node>& node,
+                                std::vector<Item>& items) const
+{
+    if (node->left)
+        collectItems(node->left, items);
+
+    // Узел может принадлежать и другим версиям, поэтому точка копируется
+    if (!node->is_deleted)
+        items.push_back(node->item);
+
+    if (node->right)
+        collectItems(node->right, items);
+}
+
+template<class Item>
+void KdTree<Item>::rebuildTree(std::shared_ptr<Node>& node)
+{
+    std::vector<Item> items;
+    items.reserve(node->size);
+    collectItems(node, items);
+    dropDeleted(node->size, items.size());
+
+    // Ось разбиения зависит только от остатка от деления глубины на число
+    // осей, поэтому вместо глубины поддерева достаточно оси его корня.
+    const std::size_t depth = node->dimension;
+    node = buildTree(items.begin(), items.end(), depth, 1);
+}
+
+template<class Item>
+void KdTree<Item>::dropDeleted(std::size_t size,
+                               std::size_t num_items) noexcept
+{
+    num_deleted_ -= size - num_items;
+}
+
+template<class Item>
+void KdTree<Item>::compactIfRequired()
+{
+    if (root_ && num_deleted_ > compaction_threshold_ * root_->size)
+        rebuildTree(root_);
+}
+
+template<class Item>
+const typename KdTree<Item>::Node*
+KdTree<Item>::findItem(const std::shared_ptr<Node>& node,
+                       const Item& item) const
+{
+    if (!node)
+        return nullptr;
+
+    if (!node->is_deleted && Node::compareEqual(item, node))
+        return node.get();
+
+    if (Node::compareLess(item, node))
+        return findItem(node->left, item);
+
+    if (auto* right_node = findItem(node->right, item))
+        return right_node;
+
+    if (node->compareLess(&item, node->dimension))
+        return nullptr;
+
+    return findItem(node->left, item);
+}
+
+template<class Item>
+typename KdTree<Item>::Node& KdTree<Item>::detachPath(const PathLink* link)
+{
+    if (!link->parent)
+        return detach(root_);
+
+    // Копия родителя ссылается на тех же потомков, что и он сам
+    auto& parent = detachPath(link->parent);
+
+    return detach(parent.left.get() == link->node ? parent.left : parent.right);
+}
+
+template<class Item>
+typename KdTree<Item>::Node*
+KdTree<Item>::detachItem(const std::shared_ptr<Node>& node,
+                         const Item& item,
+                         const PathLink* parent)
+{
+    if (!node)
+        return nullptr;
+
+    // После отделения пути узлы других версий не меняются,
+    // поэтому ссылки в кадрах выше остаются действительными
+    const PathLink link{node.get(), parent};
+    if (!node->is_deleted && Node::compareEqual(item, node))
+        return &detachPath(&link);
+
+    if (Node::compareLess(item, node))
+        return detachItem(node->left, item, &link);
+
+    if (auto* right_node = detachItem(node->right, item, &link))
+        return right_node;
+
+    if (node->compareLess(&item, node->dimension))
+        return nullptr;
+
+    return detachItem(node->left, item, &link);
+}
+
 #ifndef ALLOW_DUPLICATE_POINTS
-                              , bool update
+template<class Item>
+typename KdTree<Item>::Iterator
+KdTree<Item>::uniqueItems(Iterator first,
+                          Iterator last,
+                          bool update)
+{
+    // Устойчивая сортировка сохраняет порядок совпадающих точек, поэтому из
+    // каждой группы остаётся первая, как при вставке по одной, а при update
+    // её значение заменяется значением последней.
+    std::stable_sort(first, last, [](const Item& lhs, const Item& rhs){
+        return lhs.compareLess(rhs); });
+
+    auto out = first;
+    for (auto it = first; it != last;)
+    {
+        auto next = it + 1;
+        while (next != last && it->compareEqual(*next))
+            ++next;
+
+        if (update)
+            it->setValue(*(next - 1));
+
+        if (out != it)
+            *out = std::move(*it);
+
+        ++out;
+        it = next;
+    }
+
+    return out;
+}
 #endif
-                              )
+
+template<class Item>
+void KdTree<Item>::insertItem(std::shared_ptr<Node>& node,
+                              Item&& item,
+                              std::size_t depth,
+                              std::shared_ptr<Node>*& scapegoat)
 {
     if (!node)
     {
         node = std::make_shared<Node>(std::move(item), depth);
-        
-        return true;
+
+        return;
     }
 
+    detach(node);
+
+    auto& next_node = Node::compareLess(item, node) ? node->left : node->right;
+    insertItem(next_node, std::move(item), depth + 1, scapegoat);
+
+    // На обратном пути от листа к корню, поэтому
+    // последним запоминается самое верхнее поддерево.
+    ++node->size;
+    if (node->isUnbalanced())
+        scapegoat = &node;
+}
+
+template<class Item>
+std::size_t KdTree<Item>::insertItems(std::shared_ptr<Node>& node,
+                                      Iterator first,
+                                      Iterator last,
+                                      std::size_t depth
 #ifndef ALLOW_DUPLICATE_POINTS
-    if (Node::compareEqual(item, node))
+                                      , bool update
+#endif
+                                      )
+{
+    if (first == last)
+        return 0;
+
+    if (!node)
     {
-        if (update)
-            node->setValue(item);
-        
-        return false;
+        node = buildTree(first, last, depth, 1);
+
+        return last - first;
     }
+
+    if (last - first >= BATCH_REBUILD_FACTOR * node->size)
+    {
+        std::vector<Item> items;
+        items.reserve(node->size + (last - first));
+        collectItems(node, items);
+        dropDeleted(node->size, items.size());
+
+        const std::size_t size = items.size();
+
+#ifndef ALLOW_DUPLICATE_POINTS
+        // Ни в поддереве, ни в пакете совпадающих точек уже нет, поэтому
+        // совпадения между ними находятся за один проход по обоим сразу
+        auto compareLess = [](const Item& lhs, const Item& rhs){
+            return lhs.compareLess(rhs); };
+
+        std::sort(items.begin(), items.end(), compareLess);
+        std::sort(first, last, compareLess);
+
+        auto out = first;
+        auto existing = items.begin();
+        for (auto it = first; it != last; ++it)
+        {
+            existing = std::lower_bound(existing, items.end(), *it, compareLess);
+            if (existing == items.end() || !existing->compareEqual(*it))
+                *out++ = std::move(*it);
+            else if (update)
+                existing->setValue(*it);
+        }
+
+        last = out;
 #endif
+        std::move(first, last, std::back_inserter(items));
+        node = buildTree(items.begin(), items.end(), depth, 1);
 
-    if (Node::compareLess(item, node))
-        return insertItem(node->left, std::move(item), depth + 1);
-    
-    return insertItem(node->right, std::move(item), depth + 1);
+        return items.size() - size;
+    }
+
+    // Каждая точка части пакета вставляется в это поддерево
+    detach(node);
+
+    const auto middle = std::partition(first, last, [&node](const Item& item){
+        return Node::compareLess(item, node); });
+
+    const std::size_t num_inserted = insertItems(node->left, first, middle, depth + 1
+#ifndef ALLOW_DUPLICATE_POINTS
+                                                 , update
+#endif
+                                                 )
+                                   + insertItems(node->right, middle, last, depth + 1
+#ifndef ALLOW_DUPLICATE_POINTS
+                                                 , update
+#endif
+                                                 );
+
+    // Рост поддеревьев складывается из вставленных точек и исчезнувших
+    // при их перестроении удалённых узлов, поэтому размер пересчитывается
+    node->size = 1 + (node->left ? node->left->size : 0)
+                   + (node->right ? node->right->size : 0);
+
+    if (node->isUnbalanced())
+        rebuildTree(node);
+
+    return num_inserted;
 }
 
 template<class Item>
-void KdTree<Item>::getMinItem(const std::shared_ptr<Node>& node,
-                              const Item*& min_item,
-                              std::size_t dimension) const
+void KdTree<Item>::search(NnsSessProps& session,
+                          bool reverse_search) const
 {
-    if (node->left)
-        getMinItem(node->left, min_item, dimension);
-
-    if (not min_item or node->compareLess(min_item, dimension))
-        min_item = &node->item;
-
-    if (node->right and node->dimension != dimension)
-        getMinItem(node->right, min_item, dimension);
+    // Глубина стека не больше высоты дерева, которая при балансировке
+    // не больше log(n) / log(1 / BALANCE_FACTOR) < 2 log2(n), поэтому
+    // с повторно используемым стеком память выделяется один раз.
+    session.branches.clear();
+    session.branches.reserve(2 * std::bit_width(root_->size));
+
+    if (reverse_search)
+        reverseSearch(session);
+    else
+        forwardSearch(session);
 }
 
 template<class Item>
-bool KdTree<Item>::removeItem(std::shared_ptr<Node>& node,
-                              const Item& item)
+void KdTree<Item>::forwardSearch(NnsSessProps& session) const
 {
-    if (!node)
-        return false;
+    auto& branches = session.branches;
 
-    if (Node::compareEqual(item, node))
+    const Node* node = root_.get();
+    while (node)
     {
-        // BST для демонстрации отличий от KdT
-        if constexpr (Item::getNumAxes() == 1)
+        // Спуск к листу по ближней стороне, а дальняя откладывается
+        do
         {
-            if (node->isLeaf())
+            session.updateQueue(node);
+
+            decltype(node) next_node, aux_node;
+            if (Node::compareLess(session.item, node))
             {
-                node = nullptr;
+                next_node = node->left.get();
+                aux_node = node->right.get();
             }
-            else if (!node->left)
+            else
             {
-                node = std::move(node->right);
+                next_node = node->right.get();
+                aux_node = node->left.get();
             }
-            else if (!node->right)
+
+            if (aux_node)
+                branches.push_back({node, aux_node,
+                                    session.item.getSquaredDistance(node->item, node->dimension)});
+
+            node = next_node;
+        }
+        while (node);
+
+        // Отложенные ветви снимаются в том же порядке и при тех же найденных
+        // соседях, что и при возврате из рекурсии, а ненужные отсеиваются
+        // одним сравнением с уже вычисленным расстоянием.
+        while (!node && !branches.empty())
+        {
+            const auto branch = branches.back();
+            branches.pop_back();
+
+            if (session.isAuxRequired(branch.distance))
+                node = branch.aux;
+        }
+    }
+}
+
+template<class Item>
+void KdTree<Item>::reverseSearch(NnsSessProps& session) const
+{
+    auto& branches = session.branches;
+
+    const Node* node = root_.get();
+    while (node)
+    {
+        // Спуск к листу, и каждый узел на пути откладывается вместе с
+        // дальним поддеревом, потому что просматривается после ближнего
+        while (!node->isLeaf())
+        {
+            decltype(node) next_node, aux_node = nullptr;
+            if (!node->left)
             {
-                node = std::move(node->left);
+                next_node = node->right.get();
             }
-            else
+            else if (!node->right)
             {
-                auto min_node = &node->right;
-                while ((*min_node)->left)
-                    min_node = &(*min_node)->left;
-
-                node->item = std::move((*min_node)->item);
-                // Работает благодаря идиоме move-and-swap
-                *min_node = std::move((*min_node)->right);
+                next_node = node->left.get();
             }
-        }
-        else
-        {
-            if (node->isLeaf())
+            else if (Node::compareLess(session.item, node))
             {
-                node = nullptr;
+                next_node = node->left.get();
+                aux_node = node->right.get();
             }
             else
             {
-                if (!node->right)
-                    node->right = std::move(node->left);
-
-                const Item* min_item = nullptr;
-                getMinItem(node->right, min_item, node->dimension);
+                next_node = node->right.get();
+                aux_node = node->left.get();
+            }
 
-                node->item = *min_item;
+            branches.push_back({node, aux_node,
+                                aux_node ? session.item.getSquaredDistance(node->item, node->dimension)
+                                         : typename NnsSessProps::Pair::first_type{}});
 
-                removeItem(node->right, *min_item);
-            }
+            node = next_node;
         }
 
-        return true;
-    }
+        session.updateQueue(node);
 
-    if (Node::compareLess(item, node))
-        return removeItem(node->left, item);
-    
-    return removeItem(node->right, item);
+        node = nullptr;
+        while (!node && !branches.empty())
+        {
+            const auto branch = branches.back();
+            branches.pop_back();
+
+            session.updateQueue(branch.node);
+
+            if (branch.aux && session.isAuxRequired(branch.distance))
+                node = branch.aux;
+        }
+    }
 }
 
 template<class Item>
-void KdTree<Item>::forwardSearch(const Node* node) const
+bool KdTree<Item>::bestBinFirstSearch(NnsSessProps& session,
+                                      std::size_t max_checks) const
 {
-    search_session_->updateQueue(node);
+    // Ветвь - это поддерево и нижняя граница квадрата расстояния до его
+    // точек: наибольший из квадратов расстояний до плоскостей, отделяющих
+    // его от искомой.
+    using Branch = std::pair<SquaredDistance, const Node*>;
+    auto compareGreater = [](const Branch& lhs, const Branch& rhs){
+        return lhs.first > rhs.first; };
 
-    decltype(node) next_node, aux_node;
-    if (Node::compareLess(search_session_->item, node))
-    {
-        next_node = node->left.get();
-        aux_node = node->right.get();
-    }
-    else
+    std::vector<Branch> branches{{SquaredDistance(0), root_.get()}};
+    std::size_t num_checks = 0;
+
+    while (!branches.empty())
     {
-        next_node = node->right.get();
-        aux_node = node->left.get();
-    }
+        std::pop_heap(branches.begin(), branches.end(), compareGreater);
+        auto [bound, node] = branches.back();
+        branches.pop_back();
 
-    if (next_node)
-        forwardSearch(next_node);
+        // Остальные ветви не ближе этой, значит, и не ближе найденных соседей
+        const auto& neighbors = session.neighbors;
+        if (neighbors.isFull() && not (bound < neighbors.top().first))
+            return true;
 
-    if (aux_node && search_session_->isAuxRequired(node))
-        forwardSearch(aux_node);
-}
+        // Спуск к листу по ближней стороне, а дальняя откладывается
+        for (; node; ++num_checks)
+        {
+            if (max_checks != 0 && num_checks == max_checks)
+                return false;
 
-template<class Item>
-void KdTree<Item>::reverseSearch(const Node* node) const
-{
-    if (node->isLeaf())
-    {
-        search_session_->updateQueue(node);
+            session.updateQueue(node);
 
-        return;
-    }
+            decltype(node) next_node, aux_node;
+            if (Node::compareLess(session.item, node))
+            {
+                next_node = node->left.get();
+                aux_node = node->right.get();
+            }
+            else
+            {
+                next_node = node->right.get();
+                aux_node = node->left.get();
+            }
 
-    decltype(node) next_node, aux_node = nullptr;
-    if (!node->left)
-    {
-        next_node = node->right.get();
-    }
-    else if (!node->right)
-    {
-        next_node = node->left.get();
-    }
-    else if (Node::compareLess(search_session_->item, node))
-    {
-        next_node = node->left.get();
-        aux_node = node->right.get();
-    }
-    else
-    {
-        next_node = node->right.get();
-        aux_node = node->left.get();
-    }
+            if (aux_node)
+            {
+                const auto distance = session.item.getSquaredDistance(node->item, node->dimension);
+                const auto aux_bound = std::max(bound, distance);
+                if (!neighbors.isFull() || aux_bound < neighbors.top().first)
+                {
+                    branches.emplace_back(aux_bound, aux_node);
+                    std::push_heap(branches.begin(), branches.end(), compareGreater);
+                }
+            }
 
-    reverseSearch(next_node);
+            node = next_node;
+        }
+    }
 
-    search_session_->updateQueue(node);
+    return true;
+}
 
-    if (aux_node && search_session_->isAuxRequired(node))
-        reverseSearch(aux_node);
+template<class Item>
+template<class Visitor>
+void KdTree<Item>::rangeSearch(const Node* node,
+                               const Item& item,
+                               Distance radius,
+                               Visitor& visitor) const
+{
+    // Корень извлекается только для точек, прошедших отсев по квадрату
+    // радиуса с запасом на погрешность округления, как в FlatKdTree
+    const double bound = static_cast<double>(radius) * static_cast<double>(radius) * (1.0 + 1.0E-9);
+    if (!node->is_deleted
+        && static_cast<double>(Node::getSquaredDistance(item, node)) <= bound
+        && Node::getDistance(item, node) <= radius)
+        visitor(&node->item);
+
+    // Точки левого поддерева не больше узла по оси разбиения, а правого - не
+    // меньше, поэтому поддерево по другую сторону от плоскости разбиения,
+    // чем искомая точка, пропускается, если плоскость дальше радиуса.
+    const auto distance = Node::template getDistance<Distance>(item, node);
+
+    if (node->left && distance <= radius)
+        rangeSearch(node->left.get(), item, radius, visitor);
+
+    if (node->right && -distance <= radius)
+        rangeSearch(node->right.get(), item, radius, visitor);
 }
 
 
@@ -645,6 +1519,7 @@ KdTree<Item>::Node::Node(Item&& item,
     , dimension(depth % Item::getNumAxes())
     , left(std::move(left))
     , right(std::move(right))
+    , size(1 + (this->left ? this->left->size : 0) + (this->right ? this->right->size : 0))
 {
 }
 
@@ -656,6 +1531,8 @@ KdTree<Item>::Node::Node(const std::shared_ptr<Node>& node,
     , dimension(node->dimension)
     , left(std::move(left))
     , right(std::move(right))
+    , size(node->size)
+    , is_deleted(node->is_deleted)
 {
 }
 
@@ -680,6 +1557,13 @@ noexcept(noexcept(std::declval<Item>().getDistance(std::declval<Item>())))
     // которая определена в теле класса.
 }
 
+template<class Item>
+auto KdTree<Item>::Node::getSquaredDistance(const Item& item, const Node* node)
+noexcept(noexcept(std::declval<Item>().getSquaredDistance(std::declval<Item>())))
+{
+    return item.getSquaredDistance(node->item);
+}
+
 template<class Item>
 bool KdTree<Item>::Node::compareEqual(const Item& item,
                                       const std::shared_ptr<Node>& node) noexcept
@@ -711,48 +1595,54 @@ bool KdTree<Item>::Node::isLeaf() const noexcept
     return (!left && !right);
 }
 
-
 template<class Item>
-KdTree<Item>::NnsSessProps::NnsSessProps(const Item& item,
-                                         std::size_t num_neighbors)
-    : item(item)
-    , num_neighbors(num_neighbors)
-    , neighbors(makeQueue())
+bool KdTree<Item>::Node::isUnbalanced() const noexcept
 {
+    const double max_size = BALANCE_FACTOR * size;
+
+    return (left && left->size > max_size)
+        || (right && right->size > max_size);
 }
 
+
 template<class Item>
-auto KdTree<Item>::NnsSessProps::makeQueue()
+KdTree<Item>::NnsSessProps::NnsSessProps(const Item& item,
+                                         std::size_t num_neighbors,
+                                         double approx_epsilon,
+                                         Heap& heap,
+                                         Stack& stack)
+    : item(item)
+    , neighbors(heap)
+    , branches(stack)
+    , prune_factor((1.0 + std::max(approx_epsilon, 0.0)) * (1.0 + std::max(approx_epsilon, 0.0)))
 {
-    Container container;
-    container.reserve(num_neighbors);
-
-    return PriorityQueue{CompareLess(), std::move(container)};
+    // Память кучи сохраняется, если её хватает для num_neighbors
+    neighbors.reset(num_neighbors);
 }
 
 template<class Item>
 void KdTree<Item>::NnsSessProps::updateQueue(const Node* node)
 {
-    const auto distance = Node::getDistance(item, node);
-    if (neighbors.size() < num_neighbors)
-    {
+    if (node->is_deleted)
+        return;
+
+    const auto distance = Node::getSquaredDistance(item, node);
+    if (!neighbors.isFull())
         neighbors.push({distance, &node->item});
-    }
     else if (distance < neighbors.top().first)
-    {
-        neighbors.pop();
-        neighbors.push({distance, &node->item});
-    }
+        neighbors.replaceTop({distance, &node->item});
 }
 
 template<class Item>
-bool KdTree<Item>::NnsSessProps::isAuxRequired(const Node* node) const
+bool KdTree<Item>::NnsSessProps::isAuxRequired(typename Pair::first_type distance) const
 {
-    if (neighbors.size() < num_neighbors)
+    if (!neighbors.isFull())
         return true;
 
-    const auto distance = Node::template getDistance<decltype(neighbors.top().first)>(item, node);
-    if (ABS_EX(distance) < neighbors.top().first)
+    // При точном поиске квадраты сравниваются как есть,
+    // т.е. для целых координат без округления
+    if (prune_factor > 1.0 ? distance * prune_factor < neighbors.top().first
+                           : distance < neighbors.top().first)
         return true;
 
     return false;
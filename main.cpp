@@ -1,7 +1,11 @@
 ﻿#include <clocale>
+#include <cstdlib>
+#include <cstring>
 
+#include <new>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include <fstream>
 #include <iostream>
@@ -25,6 +29,7 @@
 
 #include "config.h"
 #include "kdtree.h"
+#include "flat_kdtree.h"
 #include "point.h"
 #include "tools.h"
 #include "io.h"
@@ -32,6 +37,179 @@
 #ifndef NDEBUG
 #include "debug.h"
 #include "tests.h"
+
+//
+// Подсчёт выделений динамической памяти для тестов (см. num_allocations).
+// Заменены все формы new и delete, чтобы любая пара из них
+// выделяла и освобождала память одним и тем же способом.
+//
+
+namespace
+{
+
+void* allocate(std::size_t size)
+{
+    void* block = std::malloc(size != 0 ? size : 1);
+    if (!block)
+        throw std::bad_alloc();
+
+    ++num_allocations;
+
+    return block;
+}
+
+void* allocate(std::size_t size, std::align_val_t alignment)
+{
+    const auto align = static_cast<std::size_t>(alignment);
+#ifdef _MSC_VER
+    void* block = _aligned_malloc(size != 0 ? size : 1, align);
+#else
+    // Размер для aligned_alloc должен быть кратен выравниванию
+    void* block = std::aligned_alloc(align, (std::max(size, std::size_t(1)) + align - 1) / align * align);
+#endif
+    if (!block)
+        throw std::bad_alloc();
+
+    ++num_allocations;
+
+    return block;
+}
+
+void deallocate(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void deallocate(void* pointer, std::align_val_t) noexcept
+{
+#ifdef _MSC_VER
+    _aligned_free(pointer);
+#else
+    std::free(pointer);
+#endif
+}
+
+}
+
+void* operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+try
+{
+    return allocate(size);
+}
+catch (...)
+{
+    return nullptr;
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+try
+{
+    return allocate(size);
+}
+catch (...)
+{
+    return nullptr;
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+try
+{
+    return allocate(size, alignment);
+}
+catch (...)
+{
+    return nullptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+try
+{
+    return allocate(size, alignment);
+}
+catch (...)
+{
+    return nullptr;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+    deallocate(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment) noexcept
+{
+    deallocate(pointer, alignment);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept
+{
+    deallocate(pointer, alignment);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(pointer, alignment);
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(pointer, alignment);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    deallocate(pointer, alignment);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    deallocate(pointer, alignment);
+}
 #endif
 
 int main(int argc, char* argv[])
@@ -47,6 +225,26 @@ int main(int argc, char* argv[])
     }
 #endif
 
+    using Item = Point<int, double, ConfigParams::axis_names.size()>;
+
+    // Преобразование файла точек в двоичный формат без интерполяции:
+    // proximal_interpolation --convert <входной файл> <выходной файл>
+    if (argc == 4 && std::strcmp(argv[1], "--convert") == 0)
+    {
+        if (!convertPoints<int, double>(argv[2], argv[3],
+                                        ConfigParams::axis_names,
+                                        ConfigParams::value_name))
+        {
+            std::cout << "\x1b[1;31mОшибка при преобразовании точек!\x1b[0m\n";
+
+            return 1;
+        }
+
+        std::cout << "\x1b[1;32mВыполнено успешно.\x1b[0m\n";
+
+        return 0;
+    }
+
     auto& config_params = ConfigParams::getInstance();
 
     std::cout << "Рабочий каталог: \x1b[4m"
@@ -66,27 +264,51 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    auto points = readPoints<int, double>(config_params.getParam<std::string>("known_points_fn"),
-                                          config_params.axis_names,
-                                          config_params.value_name);
-    if (points.empty())
-    {
-        std::cout << "\x1b[1;31mНет опорных точек!\x1b[0m\n";
+    // Если задан файл дерева, то опорные точки читаются и дерево строится
+    // только тогда, когда файла ещё нет, а иначе дерево сразу отображается
+    // в память из файла, сохранённого при одном из предыдущих запусков.
+    const auto& tree_index_fn = config_params.getParam<std::string>("tree_index_fn");
 
-        return 1;
+    KdTree<Item> tree;
+    FlatKdTree<Item> flat_tree;
+    if (!tree_index_fn.empty())
+        flat_tree = FlatKdTree<Item>::open(tree_index_fn);
+
+    if (flat_tree.isEmpty())
+    {
+        auto points = readPoints<Item>(config_params.getParam<std::string>("known_points_fn"),
+                                       config_params.axis_names,
+                                       config_params.value_name);
+        if (points.empty())
+        {
+            std::cout << "\x1b[1;31mНет опорных точек!\x1b[0m\n";
+
+            return 1;
+        }
+
+        if (tree_index_fn.empty())
+            tree = KdTree{std::move(points),
+                          config_params.getParam<std::size_t>("num_threads")};
+        else
+        {
+            flat_tree = FlatKdTree{std::move(points),
+                                   FlatKdTree<Item>::INDEX_LEAF_SIZE,
+                                   config_params.getParam<std::size_t>("num_threads")};
+            if (!flat_tree.isEmpty() && !flat_tree.save(tree_index_fn))
+                std::cout << "\x1b[1;33mОшибка при записи файла дерева!\x1b[0m\n";
+        }
     }
 
-    KdTree tree{std::move(points)};
-    if (tree.isEmpty())
+    if (tree.isEmpty() && flat_tree.isEmpty())
     {
         std::cout << "\x1b[1;31mПустое дерево!\x1b[0m\n";
 
         return 1;
     }
 
-    points = readPoints<decltype(points[0])>(config_params.getParam<std::string>("unknown_points_fn"),
-                                             config_params.axis_names,
-                                             config_params.value_name);
+    auto points = readPoints<Item>(config_params.getParam<std::string>("unknown_points_fn"),
+                                   config_params.axis_names,
+                                   config_params.value_name);
     if (points.empty())
     {
         std::cout << "\x1b[1;31mНет искомых точек!\x1b[0m\n";
@@ -117,13 +339,34 @@ int main(int argc, char* argv[])
     CONST ULARGE_INTEGER exec_time0 = getProcTime(handle);
 #endif
 
-    const auto serialized_points = shepardInterpolation(tree, points,
-                                                        config_params.getParam<std::size_t>("num_neighbors"),
-                                                        config_params.getParam<bool>("reverse_search"),
-                                                        config_params.getParam<double>("idw_power"),
-                                                        config_params.getParam<int>("json_indent"),
-                                                        config_params.axis_names,
-                                                        config_params.value_name);
+    // Результат записывается в файл по мере вычисления
+    JsonPointsWriter<int, double, Item::getNumAxes()> writer{config_params.getParam<std::string>("output_fn"),
+                                                             config_params.getParam<int>("json_indent"),
+                                                             config_params.axis_names,
+                                                             config_params.value_name};
+    if (!writer.isOpen())
+    {
+        std::cout << "\x1b[1;31mОшибка при записи результата!\x1b[0m\n";
+
+        return 1;
+    }
+
+    auto interpolate = [&config_params, &points, &writer](const auto& tree){
+        return shepardInterpolation(tree, points,
+                                    config_params.getParam<std::size_t>("num_neighbors"),
+                                    config_params.getParam<bool>("reverse_search"),
+                                    config_params.getParam<double>("approx_epsilon"),
+                                    config_params.getParam<double>("idw_power"),
+                                    config_params.getParam<double>("search_radius"),
+                                    config_params.getParam<std::size_t>("num_threads"),
+                                    config_params.getParam<bool>("morton_order"),
+                                    config_params.getParam<int>("json_indent"),
+                                    config_params.axis_names,
+                                    config_params.value_name,
+                                    writer); };
+
+    const bool interpolated = flat_tree.isEmpty() ? interpolate(tree)
+                                                  : interpolate(flat_tree);
 
 #if defined(UNDER_CONSTRUCTION) && defined(_MSC_VER)
     CONST ULARGE_INTEGER exec_time1 = getProcTime(handle);
@@ -148,29 +391,20 @@ int main(int argc, char* argv[])
               << std::defaultfloat << std::setprecision(precision);
 #endif
 
-    if (serialized_points.empty())
+    if (!interpolated)
     {
-        std::cout << "\x1b[1;31mПустой результат!\x1b[0m\n";
+        std::cout << "\x1b[1;31mОшибка при интерполяции!\x1b[0m\n";
 
         return 1;
     }
 
-#ifndef NDEBUG
-    DEBUG_INFO();
-    std::cout << serialized_points << "\n\n";
-#endif
-
-    std::ofstream out{config_params.getParam<std::string>("output_fn")};
-    if (!out.is_open())
+    if (!writer.close())
     {
         std::cout << "\x1b[1;31mОшибка при записи результата!\x1b[0m\n";
 
         return 1;
     }
 
-    out << serialized_points;
-    out.close();
-
     std::cout << "\x1b[1;32mВыполнено успешно.\x1b[0m\n";
 
     return 0;
@@ -0,0 +1,183 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+#include <utility>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Метка порядка байтов в заголовках двоичных файлов: записывается как есть
+// и при открытии файла на машине с другим порядком байтов не совпадает.
+inline constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304U;
+
+// Выравнивание массивов в двоичных файлах. Отображение в память выровнено
+// по странице, поэтому массивы можно читать прямо из него.
+inline constexpr std::size_t FILE_ALIGNMENT = 64UL;
+
+constexpr std::size_t alignFileOffset(std::size_t offset) noexcept
+{
+    return (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+}
+
+// Описание арифметического типа в заголовке двоичного файла: размер,
+// а также является ли он числом с плавающей точкой и знаковым
+template<class T>
+constexpr std::uint32_t getTypeTag() noexcept
+{
+    static_assert(std::is_arithmetic_v<T>);
+
+    return static_cast<std::uint32_t>(sizeof(T))
+           | (std::is_floating_point_v<T> ? 0x100U : 0U)
+           | (std::is_signed_v<T> ? 0x200U : 0U);
+}
+
+// Файл, целиком отображённый в память только для чтения. Страницы
+// подгружаются системой по мере обращения к ним и разделяются всеми
+// процессами, отобразившими тот же файл, поэтому открытие занимает
+// время, не зависящее от размера файла.
+class MappedFile final
+{
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string& filename) noexcept;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& file) noexcept;
+    MappedFile& operator=(MappedFile&& file) noexcept;
+
+    ~MappedFile();
+
+    bool isOpen() const noexcept;
+
+    const std::byte* getData() const noexcept;
+
+    std::size_t getSize() const noexcept;
+
+private:
+    void close() noexcept;
+
+    const std::byte* data_{nullptr};
+    std::size_t size_{0};
+};
+
+
+inline MappedFile::MappedFile(const std::string& filename) noexcept
+{
+#ifdef _WIN32
+    const HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER size{};
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        // Отображение держит файл открытым само,
+        // поэтому дескрипторы больше не нужны.
+        const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+        {
+            if (const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0))
+            {
+                data_ = static_cast<const std::byte*>(data);
+                size_ = static_cast<std::size_t>(size.QuadPart);
+            }
+
+            CloseHandle(mapping);
+        }
+    }
+
+    CloseHandle(file);
+#else
+    const int file = ::open(filename.c_str(), O_RDONLY);
+    if (file < 0)
+        return;
+
+    struct stat status{};
+    if (::fstat(file, &status) == 0 && status.st_size > 0)
+    {
+        const auto size = static_cast<std::size_t>(status.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+        if (data != MAP_FAILED)
+        {
+            data_ = static_cast<const std::byte*>(data);
+            size_ = size;
+        }
+    }
+
+    ::close(file);
+#endif
+}
+
+inline MappedFile::MappedFile(MappedFile&& file) noexcept
+    : data_(std::exchange(file.data_, nullptr))
+    , size_(std::exchange(file.size_, 0))
+{
+}
+
+inline MappedFile& MappedFile::operator=(MappedFile&& file) noexcept
+{
+    if (this != &file)
+    {
+        close();
+
+        data_ = std::exchange(file.data_, nullptr);
+        size_ = std::exchange(file.size_, 0);
+    }
+
+    return *this;
+}
+
+inline MappedFile::~MappedFile()
+{
+    close();
+}
+
+inline bool MappedFile::isOpen() const noexcept
+{
+    return data_ != nullptr;
+}
+
+inline const std::byte* MappedFile::getData() const noexcept
+{
+    return data_;
+}
+
+inline std::size_t MappedFile::getSize() const noexcept
+{
+    return size_;
+}
+
+inline void MappedFile::close() noexcept
+{
+    if (!data_)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    ::munmap(const_cast<std::byte*>(data_), size_);
+#endif
+
+    data_ = nullptr;
+    size_ = 0;
+}
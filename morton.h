@@ -0,0 +1,87 @@
+﻿#pragma once
+
+#include <cstdint>
+
+#include <span>
+#include <limits>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "point.h"
+
+// Бит на ось: больше 52 не имеет смысла, потому что координаты
+// масштабируются в double, у которого мантисса как раз 52 бита.
+template<std::size_t N>
+inline constexpr std::size_t MORTON_BITS = std::min<std::size_t>(
+    std::numeric_limits<std::uint64_t>::digits / N, 52);
+
+// Ключ точки на кривой Мортона (Z-order): координаты, приведённые к целым
+// в пределах ограничивающего параллелепипеда, чередуются побитово, начиная
+// со старших битов. Близкие ключи соответствуют близким в пространстве
+// точкам, поэтому запросы в таком порядке проходят по дереву почти одними
+// и теми же путями, а нужные узлы уже оказываются в кэше процессора.
+template<class C, class V, std::size_t N>
+std::uint64_t getMortonCode(const Point<C, V, N>& point,
+                            const double (&min)[N],
+                            const double (&scale)[N]) noexcept
+{
+    constexpr double max_cell = static_cast<double>((std::uint64_t(1) << MORTON_BITS<N>) - 1);
+
+    std::uint64_t cells[N];
+    for (std::size_t axis = 0; axis < N; ++axis)
+        cells[axis] = static_cast<std::uint64_t>(
+            std::min((point.getCoord(axis) - min[axis]) * scale[axis], max_cell));
+
+    std::uint64_t code = 0;
+    for (std::size_t bit = MORTON_BITS<N>; bit-- > 0;)
+        for (std::size_t axis = 0; axis < N; ++axis)
+            code = (code << 1) | ((cells[axis] >> bit) & 1U);
+
+    return code;
+}
+
+// Перестановка индексов точек в порядке обхода кривой Мортона
+template<class C, class V, std::size_t N>
+std::vector<std::size_t> getMortonOrder(std::span<const Point<C, V, N>> points)
+{
+    if (points.empty())
+        return {};
+
+    constexpr double max_cell = static_cast<double>((std::uint64_t(1) << MORTON_BITS<N>) - 1);
+
+    double min[N], max[N];
+    for (std::size_t axis = 0; axis < N; ++axis)
+        min[axis] = max[axis] = static_cast<double>(points.front().getCoord(axis));
+
+    for (const auto& point : points)
+        for (std::size_t axis = 0; axis < N; ++axis)
+        {
+            min[axis] = std::min(min[axis], static_cast<double>(point.getCoord(axis)));
+            max[axis] = std::max(max[axis], static_cast<double>(point.getCoord(axis)));
+        }
+
+    double scale[N];
+    for (std::size_t axis = 0; axis < N; ++axis)
+        scale[axis] = max[axis] > min[axis] ? max_cell / (max[axis] - min[axis]) : 0.0;
+
+    std::vector<std::pair<std::uint64_t, std::size_t>> codes;
+    codes.reserve(points.size());
+    for (std::size_t i = 0; i < points.size(); ++i)
+        codes.emplace_back(getMortonCode(points[i], min, scale), i);
+
+    std::sort(codes.begin(), codes.end());
+
+    std::vector<std::size_t> order;
+    order.reserve(codes.size());
+    for (const auto& code : codes)
+        order.push_back(code.second);
+
+    return order;
+}
+
+template<class C, class V, std::size_t N>
+std::vector<std::size_t> getMortonOrder(const std::vector<Point<C, V, N>>& points)
+{
+    return getMortonOrder(std::span<const Point<C, V, N>>{points});
+}
@@ -84,6 +84,13 @@ public:
 
     auto getDistance(const Point& point) const noexcept;
 
+    // Квадраты расстояний: для целых координат вычисляются точно, поэтому
+    // сравнения расстояний по ним тоже точные, и в отличие от getDistance()
+    // квадратный корень не извлекается
+    auto getSquaredDistance(const Point& point, std::size_t axis) const;
+
+    auto getSquaredDistance(const Point& point) const noexcept;
+
     C getCoord(std::size_t axis) const;
 
     V getValue() const noexcept;
@@ -344,6 +351,20 @@ auto Point<C, V, N>::getDistance(const Point& point, std::size_t axis) const
 
 template<class C, class V, std::size_t N>
 auto Point<C, V, N>::getDistance(const Point& point) const noexcept
+{
+    return std::sqrt(getSquaredDistance(point));
+}
+
+template<class C, class V, std::size_t N>
+auto Point<C, V, N>::getSquaredDistance(const Point& point, std::size_t axis) const
+{
+    const auto diff = getDistance(point, axis);
+
+    return static_cast<UnsignedType<BiggestType<C>>>(static_cast<BiggestType<C>>(diff) * diff);
+}
+
+template<class C, class V, std::size_t N>
+auto Point<C, V, N>::getSquaredDistance(const Point& point) const noexcept
 {
     UnsignedType<BiggestType<C>> sum = decltype(sum)(0);
     for (std::size_t i = 0; i < N; ++i)
@@ -354,7 +375,7 @@ auto Point<C, V, N>::getDistance(const Point& point) const noexcept
         sum += static_cast<decltype(sum)>(static_cast<BiggestType<C>>(diff) * diff);
     }
 
-    return std::sqrt(sum);
+    return sum;
 }
 
 template<class C, class V, std::size_t N>
@@ -1,14 +1,31 @@
 ﻿#pragma once
 
+#include <cmath>
+
+#include <span>
+#include <latch>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
+#include <algorithm>
 
+#include <fstream>
+#include <sstream>
 #include <iostream>
+#include <filesystem>
 
 #include <exception>
+#include <stdexcept>
 
 #include "kdtree.h"
+#include "flat_kdtree.h"
 #include "point.h"
 #include "tools.h"
+#include "io.h"
+#include "morton.h"
+#include "bounded_heap.h"
 
 #include "helper_funcs.h"
 
@@ -18,6 +35,10 @@
 
 inline constexpr std::size_t NUM_DIMS = 2UL;
 
+// Число выделений динамической памяти в этом потоке: его увеличивает
+// замена operator new в отладочной сборке main.cpp.
+inline thread_local std::size_t num_allocations{0};
+
 template<class T>
 void printNeighbors(const T& neighbors)
 {
@@ -34,8 +55,8 @@ void printTargetPoint(const T& point)
               << "\x1b[1;31m" << point << "\x1b[0m\n\n";
 }
 
-template<class C, class V, std::size_t N>
-bool testNnsSearchAndIdwInterpolation1(const KdTree<Point<C, V, N>>& tree,
+template<template<class> class Tree, class C, class V, std::size_t N>
+bool testNnsSearchAndIdwInterpolation1(const Tree<Point<C, V, N>>& tree,
                                        Point<C, V, N>& point,
                                        std::size_t num_neighbors,
                                        bool reverse_search,
@@ -71,8 +92,8 @@ bool testNnsSearchAndIdwInterpolation1(const KdTree<Point<C, V, N>>& tree,
     return true;
 }
 
-template<class C, class V, std::size_t N>
-bool testNnsSearchAndIdwInterpolation2(const KdTree<Point<C, V, N>>& tree,
+template<template<class> class Tree, class C, class V, std::size_t N>
+bool testNnsSearchAndIdwInterpolation2(const Tree<Point<C, V, N>>& tree,
                                        Point<C, V, N>& point,
                                        std::size_t num_neighbors,
                                        bool reverse_search,
@@ -82,7 +103,7 @@ bool testNnsSearchAndIdwInterpolation2(const KdTree<Point<C, V, N>>& tree,
     DEBUG_INFO();
 #endif
 
-    decltype(getReturnType(&KdTree<Point<C, V, N>>::shepardInterpolation)) neighbors;
+    decltype(getReturnType(&Tree<Point<C, V, N>>::shepardInterpolation)) neighbors;
 
     try
     {
@@ -104,50 +125,12 @@ bool testNnsSearchAndIdwInterpolation2(const KdTree<Point<C, V, N>>& tree,
     return true;
 }
 
-inline bool unitTests() noexcept
+template<template<class> class Tree, class C, class V, std::size_t N>
+bool testNnsSearchAndIdwInterpolation(const Tree<Point<C, V, N>>& tree,
+                                      std::size_t num_neighbors,
+                                      double ref_value) noexcept
 {
-#ifndef NDEBUG
-    DEBUG_INFO();
-#endif
-
-    using Array = int[];
-    using Point = Point<int, double, NUM_DIMS>;
-
-    KdTree tree = KdTree(std::vector<Point>{
-        {{8, 34, 88}, 89.6548L},
-        {{-3}, 58.3256},
-        {{-9.0L, 8.0L}, 8.36633},
-        Point{Array{45, 65}, 4.7921F},
-        Point{Array{21, -12}, -5.81225},
-        Point{Array{0, 77}, 13.03254185L},
-        Point{Array{65, 42}, -69.00115},
-        Point{Array{13, -24}, 80.41564},
-        Point{Array{55, 33}, -22.1515F},
-        Point{Array{94, -65}, 42.648955},
-        {{-32, -11}, -3.5135F}
-    });
-
-    std::cout << tree << '\n';
-
-    if (tree.isEmpty())
-        return false;
-
-    if (!tree.remove(Point{{-3, 0}}) ||
-        !tree.insert({{1, 1}, -45.102548}) ||
-        !tree.insert({{50, 75}, 10.201111}) ||
-        !tree.remove(Point{{45, 65}}) ||
-        !tree.insert({{60, 80}, 2.718281828459045}) ||
-#ifndef ALLOW_DUPLICATE_POINTS
-         tree.insert({{60, 80}, 0.0}) ||
-#endif
-         tree.remove(Point{{99, 99}}))
-        return false;
-
-    std::cout << tree << '\n';
-
-    Point point{{0, 0}};
-    const double ref_value = -43.91734030;
-    const std::size_t num_neighbors = 4UL;
+    Point<C, V, N> point{{0, 0}};
     if (!testNnsSearchAndIdwInterpolation1(tree, point,
                                            num_neighbors,
                                            false,
@@ -172,3 +155,1546 @@ inline bool unitTests() noexcept
 
     return true;
 }
+
+template<class Point>
+std::vector<Point> makeRandomPoints(std::size_t num_points,
+                                    std::mt19937& engine)
+{
+    std::uniform_int_distribution<int> coord{-10000, 10000};
+
+    std::vector<Point> points;
+    points.reserve(num_points);
+    for (std::size_t i = 0; i < num_points; ++i)
+        points.push_back({{coord(engine), coord(engine)}, static_cast<double>(i)});
+
+    return points;
+}
+
+template<class Point>
+bool compareNeighbors(const std::vector<Point>& lhs,
+                      const std::vector<Point>& rhs) noexcept
+{
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                      [](const Point& lhs, const Point& rhs){
+                          return lhs.compareExactlyEqual(rhs); });
+}
+
+// Сверка найденных соседей с полным перебором: квадраты расстояний до них
+// должны идти по возрастанию и совпадать с k наименьшими, а при приближённом
+// поиске i-й сосед может быть не более чем в (1 + approx_epsilon) раз дальше
+// i-го ближайшего. Равноудалённые точки разные деревья отдают в разном
+// порядке, поэтому сравниваются только расстояния.
+template<class Point>
+bool checkNeighbors(const std::vector<Point>& neighbors,
+                    const std::vector<Point>& points,
+                    const Point& query,
+                    std::size_t num_neighbors,
+                    double approx_epsilon = 0.0)
+{
+    using SquaredDistance = decltype(query.getSquaredDistance(query));
+
+    std::vector<SquaredDistance> distances;
+    distances.reserve(points.size());
+    for (const auto& point : points)
+        distances.push_back(point.getSquaredDistance(query));
+
+    const std::size_t size = std::min(num_neighbors, points.size());
+    std::partial_sort(distances.begin(), distances.begin() + size, distances.end());
+
+    if (neighbors.size() != size)
+        return false;
+
+    const double bound = (1.0 + approx_epsilon) * (1.0 + approx_epsilon);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        const auto distance = neighbors[i].getSquaredDistance(query);
+        if ((i != 0 && distance < neighbors[i - 1].getSquaredDistance(query))
+            || (approx_epsilon == 0.0 ? distance != distances[i]
+                                      : static_cast<double>(distance) > bound * static_cast<double>(distances[i])))
+            return false;
+    }
+
+    return true;
+}
+
+inline bool testParallelBuild() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Точек достаточно, чтобы построение разделилось между потоками
+    const std::size_t num_points = 4 * KdTree<Point>::PARALLEL_BUILD_CUTOFF;
+
+    std::mt19937 engine{42};
+    auto points = makeRandomPoints<Point>(num_points, engine);
+
+    // Разбиение детерминировано и не зависит от числа потоков,
+    // поэтому все четыре дерева должны давать одинаковый ответ.
+    const KdTree serial_tree{std::vector<Point>{points}};
+    const KdTree parallel_tree{std::vector<Point>{points}, 4};
+    const FlatKdTree serial_flat_tree{std::vector<Point>{points}};
+    const FlatKdTree parallel_flat_tree{std::move(points), 1, 4};
+
+    const auto queries = makeRandomPoints<Point>(100, engine);
+
+    const std::size_t num_neighbors = 10UL;
+    for (const auto& point : queries)
+    {
+        const auto neighbors = serial_tree.neighborsSearch(point, num_neighbors, false);
+        if (neighbors.size() != num_neighbors
+            || !compareNeighbors(neighbors, parallel_tree.neighborsSearch(point, num_neighbors, false))
+            || !compareNeighbors(neighbors, serial_flat_tree.neighborsSearch(point, num_neighbors, false))
+            || !compareNeighbors(neighbors, parallel_flat_tree.neighborsSearch(point, num_neighbors, false)))
+            return false;
+    }
+
+    return true;
+}
+
+inline bool testConcurrentSearch() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{7};
+    KdTree tree{makeRandomPoints<Point>(10000, engine)};
+    const auto queries = makeRandomPoints<Point>(200, engine);
+
+    const std::size_t num_neighbors = 16UL;
+    // Прямой и обратный поиск могут по-разному выбирать
+    // из равноудалённых точек, поэтому ответы для каждого.
+    std::vector<std::vector<Point>> expected[2];
+    for (const auto& point : queries)
+        for (bool reverse_search : {false, true})
+            expected[reverse_search].push_back(tree.neighborsSearch(point,
+                                                                    num_neighbors,
+                                                                    reverse_search));
+
+    // Все потоки одновременно ищут в одном и том же дереве
+    const std::size_t num_threads = 4UL;
+    std::vector<char> results(num_threads, false);
+    {
+        std::vector<std::jthread> threads;
+        for (std::size_t t = 0; t < num_threads; ++t)
+            threads.emplace_back([&, t](){
+                bool result = true;
+                for (std::size_t i = 0; i < queries.size(); ++i)
+                    result = result && compareNeighbors(expected[t % 2][i],
+                                                        tree.neighborsSearch(queries[i],
+                                                                             num_neighbors,
+                                                                             t % 2 != 0));
+                results[t] = result;
+            });
+    }
+
+    if (std::find(results.begin(), results.end(), false) != results.end())
+        return false;
+
+    // Сессий поиска больше нет, поэтому вставке ничто не мешает
+    return tree.insert({{20000, 20000}, 1.0});
+}
+
+inline bool testMortonOrder() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Старший бит ключа берётся от первой оси, поэтому
+    // квадрат 2x2 обходится так: (0,0) (0,1) (1,0) (1,1)
+    const std::vector<Point> points{
+        {{1, 1}, 0.0},
+        {{0, 0}, 0.0},
+        {{1, 0}, 0.0},
+        {{0, 1}, 0.0}
+    };
+
+    return getMortonOrder(points) == std::vector<std::size_t>{1, 3, 2, 0};
+}
+
+inline bool testBoundedHeap() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    std::mt19937 engine{3};
+    std::uniform_int_distribution<int> number{-1000, 1000};
+
+    std::vector<int> numbers(500);
+    for (auto& n : numbers)
+        n = number(engine);
+
+    // Одна и та же куча используется повторно: сначала с хранением
+    // элементов внутри объекта, потом в векторе, потом снова внутри.
+    BoundedHeap<int, 8> heap;
+    for (std::size_t capacity : {5UL, 8UL, 100UL, 3UL, 700UL})
+    {
+        heap.reset(capacity);
+        for (int n : numbers)
+            heap.update(n);
+
+        auto expected = numbers;
+        expected.resize(std::min(capacity, numbers.size()));
+        std::partial_sort_copy(numbers.begin(), numbers.end(),
+                               expected.begin(), expected.end());
+
+        heap.sort();
+        if (!std::equal(heap.begin(), heap.end(), expected.begin(), expected.end()))
+            return false;
+    }
+
+    return true;
+}
+
+inline bool testRadiusSearch() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{11};
+    auto points = makeRandomPoints<Point>(5000, engine);
+    // Точки ровно на границе радиуса 5 от (0,0) и в самом центре
+    points.push_back({{3, 4}, -1.0});
+    points.push_back({{0, -5}, -2.0});
+    points.push_back({{0, 0}, -3.0});
+
+    const KdTree tree{std::vector<Point>{points}};
+    const FlatKdTree flat_tree{std::vector<Point>{points}};
+    const FlatKdTree bucket_tree{std::vector<Point>{points}, 16};
+
+    auto queries = makeRandomPoints<Point>(50, engine);
+    queries.push_back(Point{{0, 0}});
+
+    // Значения точек различны, поэтому по ним и упорядочиваются
+    auto sortNeighbors = [](std::vector<Point>& neighbors){
+        std::sort(neighbors.begin(), neighbors.end(),
+                  [](const Point& lhs, const Point& rhs){
+                      return lhs.getValue() < rhs.getValue(); }); };
+
+    auto toPoints = [](const std::vector<const Point*>& buffer){
+        std::vector<Point> neighbors;
+        for (const auto* neighbor : buffer)
+            neighbors.push_back(*neighbor);
+        return neighbors; };
+
+    // Один буфер на все запросы
+    std::vector<const Point*> buffer;
+    for (const auto& point : queries)
+        for (double radius : {0.0, 5.0, 300.0, 2500.0})
+        {
+            std::vector<Point> expected;
+            for (const auto& known_point : points)
+                if (known_point.getDistance(point) <= radius)
+                    expected.push_back(known_point);
+            sortNeighbors(expected);
+
+            if (tree.rangeCount(point, radius) != expected.size()
+                || flat_tree.rangeCount(point, radius) != expected.size()
+                || bucket_tree.rangeCount(point, radius) != expected.size())
+                return false;
+
+            for (const auto* radius_tree : {&flat_tree, &bucket_tree})
+            {
+                radius_tree->radiusSearch(point, radius, buffer);
+
+                auto neighbors = toPoints(buffer);
+                sortNeighbors(neighbors);
+                if (!compareNeighbors(neighbors, expected))
+                    return false;
+            }
+
+            if (tree.radiusSearch(point, radius, buffer) != expected.size())
+                return false;
+
+            auto neighbors = toPoints(buffer);
+            sortNeighbors(neighbors);
+            if (!compareNeighbors(neighbors, expected))
+                return false;
+
+            // ОВР по указателям в произвольном порядке и по копиям точек
+            if (!expected.empty()
+                && !isEqual(shepardInterpolation(point, buffer), shepardInterpolation(point, expected)))
+                return false;
+        }
+
+    return true;
+}
+
+inline bool testApproxSearch() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{5};
+    auto points = makeRandomPoints<Point>(5000, engine);
+
+    const KdTree tree{std::vector<Point>{points}};
+    const FlatKdTree bucket_tree{std::move(points), 16};
+
+    const auto queries = makeRandomPoints<Point>(100, engine);
+
+    const std::size_t num_neighbors = 50UL;
+    for (const auto& point : queries)
+        for (bool reverse_search : {false, true})
+        {
+            const auto exact = tree.neighborsSearch(point, num_neighbors, reverse_search);
+
+            // При ε = 0 поиск точный
+            if (!compareNeighbors(exact, tree.neighborsSearch(point, num_neighbors,
+                                                              reverse_search, 0.0)))
+                return false;
+
+            // Каждый сосед (они упорядочены по расстоянию) не более
+            // чем в (1 + ε) раз дальше точного соседа с тем же номером
+            for (double approx_epsilon : {0.5, 2.0})
+                for (const auto& approx : {tree.neighborsSearch(point, num_neighbors,
+                                                                reverse_search, approx_epsilon),
+                                           bucket_tree.neighborsSearch(point, num_neighbors,
+                                                                       reverse_search, approx_epsilon)})
+                {
+                    if (approx.size() != exact.size())
+                        return false;
+
+                    for (std::size_t i = 0; i < exact.size(); ++i)
+                        if (approx[i].getDistance(point) >
+                            (1.0 + approx_epsilon) * exact[i].getDistance(point) + EPSILON<double>)
+                            return false;
+                }
+        }
+
+    return true;
+}
+
+template<class Tree, class Point>
+bool testBestBinFirstSearch(const Tree& tree,
+                            const std::vector<Point>& queries) noexcept
+{
+    const std::size_t num_neighbors = 10UL;
+    for (const auto& point : queries)
+    {
+        const auto expected = tree.neighborsSearch(point, num_neighbors, false);
+
+        // Порядок просмотра другой, поэтому из равноудалённых
+        // точек могут быть выбраны другие: сравниваются расстояния.
+        for (std::size_t max_checks : {0UL, 100000UL, 30UL, 1UL})
+        {
+            bool exact = false;
+            const auto neighbors = tree.bestBinFirstSearch(point, num_neighbors, max_checks, exact);
+
+            // С бюджетом в 30 точек результат бывает и точным
+            if (((max_checks == 0 || max_checks > 1000UL) != exact && max_checks != 30UL)
+                || neighbors.size() > expected.size()
+                || (exact && neighbors.size() != expected.size()))
+                return false;
+
+            for (std::size_t i = 0; i < neighbors.size(); ++i)
+            {
+                const double distance = neighbors[i].getDistance(point);
+                if (exact ? !isEqual(distance, expected[i].getDistance(point))
+                          : distance < expected[i].getDistance(point))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+inline bool testBestBinFirstSearch() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{13};
+    auto points = makeRandomPoints<Point>(5000, engine);
+
+    const auto queries = makeRandomPoints<Point>(100, engine);
+
+    return testBestBinFirstSearch(KdTree{std::vector<Point>{points}}, queries)
+        && testBestBinFirstSearch(FlatKdTree{std::vector<Point>{points}}, queries)
+        && testBestBinFirstSearch(FlatKdTree{std::move(points), 16}, queries);
+}
+
+inline bool testDynamicBalance() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Высота дерева, в котором каждое поддерево сбалансировано
+    auto isBalanced = [](const KdTree<Point>& tree){
+        return tree.getHeight() <= 2 + std::log(static_cast<double>(tree.getSize()))
+                                     / std::log(1.0 / KdTree<Point>::BALANCE_FACTOR); };
+
+    // Точки поступают по одной в порядке возрастания первой координаты,
+    // и без перестроения дерево выродилось бы в список длиной num_points
+    const int num_points = 5000;
+    std::mt19937 engine{17};
+    std::uniform_int_distribution<int> coord{-1000, 1000};
+
+    KdTree<Point> tree;
+    std::vector<Point> points;
+    for (int i = 0; i < num_points; ++i)
+    {
+        points.push_back({{i, coord(engine)}, static_cast<double>(i)});
+        if (!tree.insert(Point{points.back()}))
+            return false;
+    }
+
+    if (tree.getSize() != points.size() || !isBalanced(tree))
+        return false;
+
+    // Удаляется половина точек в случайном порядке
+    std::shuffle(points.begin(), points.end(), engine);
+    for (std::size_t i = 0; i < points.size() / 2; ++i)
+        if (!tree.remove(points[i]))
+            return false;
+
+    points.erase(points.begin(), points.begin() + points.size() / 2);
+    if (tree.getSize() != points.size() || !isBalanced(tree))
+        return false;
+
+    // Оставшиеся точки находятся так же, как в заново построенном дереве
+    const FlatKdTree flat_tree{std::vector<Point>{points}};
+    for (const auto& point : makeRandomPoints<Point>(100, engine))
+    {
+        const auto expected = flat_tree.neighborsSearch(point, 10, false);
+        const auto neighbors = tree.neighborsSearch(point, 10, false);
+        for (std::size_t i = 0; i < expected.size(); ++i)
+            if (neighbors.size() != expected.size()
+                || !isEqual(neighbors[i].getDistance(point), expected[i].getDistance(point)))
+                return false;
+    }
+
+    return true;
+}
+
+// Без проверки совпадений точек пакетам нечего обновлять и отбрасывать
+#ifndef ALLOW_DUPLICATE_POINTS
+inline bool testBatchUpdate() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Координаты из небольшого диапазона, чтобы точки часто совпадали как
+    // между собой внутри пакета, так и с уже имеющимися в дереве
+    std::mt19937 engine{23};
+    std::uniform_int_distribution<int> coord{-100, 100};
+    std::uniform_real_distribution<double> value{-100.0, 100.0};
+    auto makePoints = [&](std::size_t num_points){
+        std::vector<Point> points;
+        for (std::size_t i = 0; i < num_points; ++i)
+            points.push_back({{coord(engine), coord(engine)}, value(engine)});
+        return points; };
+
+    // Пакеты вставляются в пустое дерево, в большое поддерево
+    // (спуском) и соразмерно ему (перестроением), а результат
+    // сравнивается со вставкой тех же точек по одной.
+    KdTree<Point> tree, expected_tree;
+    std::vector<Point> points;
+    for (std::size_t batch_size : {2000UL, 300UL, 3000UL})
+    {
+        for (bool update : {false, true})
+        {
+            const auto batch = makePoints(batch_size);
+            points.insert(points.end(), batch.begin(), batch.end());
+
+            std::size_t expected = 0;
+            for (const auto& point : batch)
+                expected += expected_tree.insert(Point{point}, update);
+
+            if (tree.insert(std::vector<Point>{batch}, update) != expected
+                || tree.getSize() != expected_tree.getSize())
+                return false;
+        }
+    }
+
+    // Каждая точка есть в обоих деревьях с одним и тем же значением
+    auto compareTrees = [&](){
+        for (const auto& point : points)
+        {
+            const auto neighbors = tree.neighborsSearch(point, 1, false);
+            const auto expected = expected_tree.neighborsSearch(point, 1, false);
+            if (neighbors.size() != expected.size()
+                || (!expected.empty()
+                    && (!isEqual(neighbors[0].getDistance(point), expected[0].getDistance(point))
+                        || (expected[0].compareEqual(point)
+                            && !isEqual(neighbors[0].getValue(), expected[0].getValue())))))
+                return false;
+        }
+        return true; };
+
+    if (!compareTrees())
+        return false;
+
+    // Удаляются небольшой и большой пакеты, в том числе повторы
+    // точек внутри пакета и точки, которых в дереве никогда не было
+    std::shuffle(points.begin(), points.end(), engine);
+    for (std::size_t batch_size : {200UL, 3000UL})
+    {
+        std::vector<Point> batch{points.end() - batch_size, points.end()};
+        points.resize(points.size() - batch_size);
+        batch.push_back(batch.front());
+        batch.push_back({{1000, 1000}, 0.0});
+
+        std::size_t expected = 0;
+        for (const auto& point : batch)
+            expected += expected_tree.remove(point);
+
+        if (tree.remove(batch) != expected
+            || tree.getSize() != expected_tree.getSize()
+            || !compareTrees())
+            return false;
+    }
+
+    return tree.getHeight() <= 2 + std::log(static_cast<double>(tree.getSize()))
+                                 / std::log(1.0 / KdTree<Point>::BALANCE_FACTOR);
+}
+#endif
+
+inline bool testTombstones() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    const int num_points = 5000;
+    std::mt19937 engine{29};
+    std::uniform_int_distribution<int> coord{-1000, 1000};
+
+    std::vector<Point> points;
+    for (int i = 0; i < num_points; ++i)
+        points.push_back({{coord(engine), i}, static_cast<double>(i)});
+
+    // Без уплотнения удалённые узлы остаются в дереве
+    KdTree<Point> tree{std::vector<Point>{points}};
+    tree.setCompactionThreshold(1.0);
+
+    const std::size_t height = tree.getHeight();
+    std::shuffle(points.begin(), points.end(), engine);
+
+    std::vector<Point> removed{points.begin(), points.begin() + num_points * 2 / 5};
+    points.erase(points.begin(), points.begin() + removed.size());
+    for (const auto& point : removed)
+        if (!tree.remove(point))
+            return false;
+
+    // Повторно удалить нельзя, а вставить снова можно
+    if (tree.remove(removed.front())
+        || !tree.insert(Point{removed.back()}))
+        return false;
+
+    points.push_back(removed.back());
+
+    auto compareTrees = [&](){
+        if (tree.getSize() != points.size()
+            || tree.rangeCount(Point{{0, 0}}, 1.0E6) != points.size())
+            return false;
+
+        const FlatKdTree flat_tree{std::vector<Point>{points}};
+        for (const auto& point : makeRandomPoints<Point>(100, engine))
+        {
+            bool exact = false;
+            const auto expected = flat_tree.neighborsSearch(point, 10, false);
+            for (const auto& neighbors : {tree.neighborsSearch(point, 10, false),
+                                          tree.neighborsSearch(point, 10, true),
+                                          tree.bestBinFirstSearch(point, 10, 0, exact)})
+                for (std::size_t i = 0; i < expected.size(); ++i)
+                    if (neighbors.size() != expected.size()
+                        || !isEqual(neighbors[i].getDistance(point), expected[i].getDistance(point)))
+                        return false;
+        }
+
+        return true; };
+
+    if (tree.getHeight() < height || !compareTrees())
+        return false;
+
+    // Уплотнение выбрасывает удалённые узлы, не меняя результатов поиска
+    if (!tree.compact()
+        || tree.getHeight() >= height
+        || !compareTrees())
+        return false;
+
+    // С порогом по умолчанию дерево уплотняется само и в конце пустеет
+    tree.setCompactionThreshold(KdTree<Point>::COMPACTION_THRESHOLD);
+    for (const auto& point : points)
+        if (!tree.remove(point))
+            return false;
+
+    return tree.isEmpty() && tree.getHeight() == 0;
+}
+
+inline bool testSnapshots() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    const int num_points = 5000;
+    std::mt19937 engine{31};
+    std::uniform_int_distribution<int> coord{-1000, 1000};
+
+    std::vector<Point> points;
+    for (int i = 0; i < num_points; ++i)
+        points.push_back({{coord(engine), i}, static_cast<double>(i)});
+
+    KdTree<Point> tree{std::vector<Point>{points}};
+    const auto queries = makeRandomPoints<Point>(200, engine);
+
+    // Ответы снимка, полученные до того, как исходное дерево начало меняться
+    const std::size_t num_neighbors = 16UL;
+    const KdTree<Point> snapshot = tree;
+    std::vector<std::vector<Point>> expected;
+    for (const auto& point : queries)
+        expected.push_back(snapshot.neighborsSearch(point, num_neighbors, false));
+
+    // Снимок читается в нескольких потоках, пока дерево меняется в этом
+    const std::size_t num_threads = 4UL;
+    std::vector<char> results(num_threads, false);
+    {
+        std::vector<std::jthread> threads;
+        for (std::size_t t = 0; t < num_threads; ++t)
+            threads.emplace_back([&, t](){
+                bool result = true;
+                for (std::size_t n = 0; n < 10; ++n)
+                    for (std::size_t i = 0; i < queries.size(); ++i)
+                        result = result && compareNeighbors(expected[i],
+                                                            snapshot.neighborsSearch(queries[i],
+                                                                                     num_neighbors,
+                                                                                     false));
+                results[t] = result;
+            });
+
+        // Удаление по одной и пакетом, вставка с обновлением значений
+        // уже имеющихся точек и новых точек, а в конце уплотнение
+        std::shuffle(points.begin(), points.end(), engine);
+        for (std::size_t i = 0; i < 500; ++i)
+            tree.remove(points[i]);
+
+        tree.remove(std::span{points}.subspan(500, 500));
+        points.erase(points.begin(), points.begin() + 1000);
+
+#ifndef ALLOW_DUPLICATE_POINTS
+        for (std::size_t i = 0; i < 500; ++i)
+        {
+            points[i].setValue(-1.0);
+            tree.insert(Point{points[i]}, true);
+        }
+#endif
+
+        std::vector<Point> batch;
+        for (int i = num_points; i < num_points + 1000; ++i)
+            batch.push_back({{coord(engine), i}, static_cast<double>(i)});
+
+        points.insert(points.end(), batch.begin(), batch.end());
+        tree.insert(std::move(batch));
+        tree.compact();
+    }
+
+    if (std::find(results.begin(), results.end(), false) != results.end()
+        || snapshot.getSize() != static_cast<std::size_t>(num_points)
+        || tree.getSize() != points.size())
+        return false;
+
+    // Изменения видны только в самом дереве
+    const FlatKdTree flat_tree{std::vector<Point>{points}};
+    for (std::size_t i = 0; i < queries.size(); ++i)
+        if (!compareNeighbors(expected[i], snapshot.neighborsSearch(queries[i], num_neighbors, false))
+            || !compareNeighbors(flat_tree.neighborsSearch(queries[i], num_neighbors, false),
+                                 tree.neighborsSearch(queries[i], num_neighbors, false)))
+            return false;
+
+    return true;
+}
+
+inline bool testSnapshotPathCopies() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{71};
+    const auto points = makeRandomPoints<Point>(2000, engine);
+
+    std::vector<Point> missing;
+    for (int i = 0; i < 100; ++i)
+        missing.push_back({{20001 + i, i}, 0.0});
+
+    KdTree tree{std::vector<Point>{points}};
+    const KdTree snapshot = tree;
+
+    // Пока жив снимок, вставка уже имеющейся точки и удаление отсутствующих
+    // дерево не меняют, поэтому не копируют ни одного узла
+    std::size_t base_allocations = num_allocations;
+#ifndef ALLOW_DUPLICATE_POINTS
+    for (std::size_t i = 0; i < 100; ++i)
+        if (tree.insert(Point{points[i]}))
+            return false;
+#endif
+    for (const auto& point : missing)
+        if (tree.remove(point))
+            return false;
+
+    if (tree.remove(std::span{missing}) != 0
+        || num_allocations != base_allocations)
+        return false;
+
+    // Удаление имеющейся точки копирует только путь к её узлу
+    base_allocations = num_allocations;
+    if (!tree.remove(points.front()))
+        return false;
+
+    const std::size_t num_copies = num_allocations - base_allocations;
+
+    return num_copies != 0
+           && num_copies <= tree.getHeight()
+           && snapshot.getSize() == points.size()
+           && tree.getSize() == points.size() - 1;
+}
+
+inline bool testTreeFile() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{37};
+    auto points = makeRandomPoints<Point>(5000, engine);
+    const auto queries = makeRandomPoints<Point>(100, engine);
+
+    std::error_code error;
+    const auto path = std::filesystem::temp_directory_path(error) / "proximal_tree_test.bin";
+    const std::string filename = path.string();
+
+    bool result = true;
+    for (std::size_t leaf_size : {1UL, 16UL})
+    {
+        const FlatKdTree tree{std::vector<Point>{points}, leaf_size};
+        if (!tree.save(filename))
+            return false;
+
+        // Копия отображённого дерева разделяет с ним отображение
+        // и остаётся рабочей после того, как оригинал уничтожен.
+        FlatKdTree<Point> mapped_tree;
+        {
+            const auto opened_tree = FlatKdTree<Point>::open(filename);
+            mapped_tree = opened_tree;
+        }
+
+        result = result
+                 && mapped_tree.getSize() == tree.getSize()
+                 && mapped_tree.getLeafSize() == tree.getLeafSize();
+
+        std::vector<const Point*> buffer;
+        for (const auto& point : queries)
+        {
+            result = result
+                     && compareNeighbors(mapped_tree.neighborsSearch(point, 16, false),
+                                         tree.neighborsSearch(point, 16, false))
+                     && compareNeighbors(mapped_tree.neighborsSearch(point, 16, true),
+                                         tree.neighborsSearch(point, 16, true))
+                     && mapped_tree.rangeCount(point, 3000.0) == tree.rangeCount(point, 3000.0);
+
+            Point mapped_point = point, expected_point = point;
+            mapped_tree.shepardInterpolation(mapped_point, 16, false, 2.0);
+            tree.shepardInterpolation(expected_point, 16, false, 2.0);
+            result = result && isEqual(mapped_point.getValue(), expected_point.getValue());
+        }
+    }
+
+    // Обрезанный и чужой файлы не открываются, как и несуществующий
+    std::filesystem::resize_file(path, 1000, error);
+    result = result && !error && FlatKdTree<Point>::open(filename).isEmpty();
+
+    {
+        std::ofstream file{filename, std::ios::binary};
+        file << "[{\"x\": 1, \"y\": 2, \"value\": 3.0}]";
+    }
+    result = result && FlatKdTree<Point>::open(filename).isEmpty();
+
+    std::filesystem::remove(path, error);
+    result = result && FlatKdTree<Point>::open(filename).isEmpty();
+
+    return result;
+}
+
+inline bool testBinaryPoints() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    constexpr std::array axis_names{"x", "y"};
+
+    std::mt19937 engine{41};
+    auto points = makeRandomPoints<Point>(5000, engine);
+    // Повторы с другими значениями: остаются первые из совпавших точек
+    for (std::size_t i = 0; i < 100; ++i)
+        points.push_back({{points[i].getCoord(0), points[i].getCoord(1)}, -1.0});
+
+    std::error_code error;
+    const auto directory = std::filesystem::temp_directory_path(error);
+    const auto json_fn = (directory / "proximal_points_test.json").string();
+    const auto binary_fn = (directory / "proximal_points_test.bin").string();
+
+    writePoints(json_fn, points, -1, axis_names, "value");
+
+    const auto json_points = readPoints<Point>(json_fn, axis_names, "value");
+    bool result = !json_points.empty()
+                  && convertPoints<int, double>(json_fn, binary_fn, axis_names, "value")
+                  && compareNeighbors(readPoints<Point>(binary_fn, axis_names, "value"), json_points);
+
+    // Двоичный файл с повторами читается так же, как и JSON
+    result = result
+             && writeBinaryPoints(binary_fn, points)
+             && compareNeighbors(readPoints<Point>(binary_fn, axis_names, "value"), json_points);
+
+    // Другой тип значения и обрезанный файл не читаются
+    result = result
+             && readPoints<::Point<int, float, NUM_DIMS>>(binary_fn, axis_names, "value").empty();
+
+    std::filesystem::resize_file(binary_fn, 1000, error);
+    result = result
+             && !error
+             && readPoints<Point>(binary_fn, axis_names, "value").empty();
+
+    std::filesystem::remove(json_fn, error);
+    std::filesystem::remove(binary_fn, error);
+
+    return result;
+}
+
+inline bool testJsonPoints() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    constexpr std::array axis_names{"x", "y"};
+
+    std::error_code error;
+    const auto filename = (std::filesystem::temp_directory_path(error) / "proximal_json_test.json").string();
+
+    auto read = [&](const char* text){
+        {
+            std::ofstream file{filename};
+            file << text;
+        }
+        return readPoints<Point>(filename, axis_names, "value"); };
+
+    // Лишние поля пропускаются вместе с вложенными в них массивами
+    // и объектами, нечисловое или отсутствующее значение - ноль,
+    // а из совпавших точек остаётся первая.
+    const auto points = read(R"([
+        {"x": 1, "y": 2, "value": 3.5, "tags": [1, {"x": "a"}], "meta": {"y": [null]}},
+        {"name": "b", "y": -4, "x": 7.9, "value": "none"},
+        {"x": 5, "y": 6},
+        {"x": 1, "y": 2, "value": -1.0}
+    ])");
+
+#ifndef ALLOW_DUPLICATE_POINTS
+    const std::size_t num_points = 3UL;
+#else
+    const std::size_t num_points = 4UL;
+#endif
+
+    bool result = points.size() == num_points
+                  && points[0].compareExactlyEqual(Point{{1, 2}, 3.5})
+                  && points[1].compareExactlyEqual(Point{{7, -4}, 0.0})
+                  && points[2].compareExactlyEqual(Point{{5, 6}, 0.0});
+
+    // Ошибки разбора и структуры файла
+    for (const char* text : {R"({"x": 1, "y": 2})",
+                             R"([])",
+                             R"([{"x": 1, "y": 2}, 3])",
+                             R"([{"x": 1, "y": 2}, [1, 2]])",
+                             R"([{"x": 1}])",
+                             R"([{"x": 1, "y": "2"}])",
+                             R"([{"x": 1, "y": {"value": 2}}])",
+                             R"([{"x": 1, "y": 2},)",
+                             R"([{"x": 1, "y": 2}] [])"})
+        result = result && read(text).empty();
+
+    // Ошибки классифицируются так же, как при разборе в DOM: в объекте меньше
+    // полей, чем осей (повтор поля оси - одно поле), - неверный элемент
+    // массива, а иначе - отсутствующая или нечисловая координата
+    auto readError = [&](const char* text){
+        {
+            std::ofstream file{filename};
+            file << text;
+        }
+
+        std::ifstream file{filename};
+        std::vector<Point> points;
+        std::ostringstream error_stream;
+        auto* buffer = std::cerr.rdbuf(error_stream.rdbuf());
+        readPoints(file, points, axis_names, "value");
+        std::cerr.rdbuf(buffer);
+
+        return error_stream.str(); };
+
+    for (const auto& [text, message] : {std::pair{R"([])", "The file is ill-formed!\n"},
+                                        std::pair{R"([{"x": 1}])", "The array is invalid!\n"},
+                                        std::pair{R"([{"x": "1"}])", "The array is invalid!\n"},
+                                        std::pair{R"([{"y": 1, "y": 2}])", "The array is invalid!\n"},
+                                        std::pair{R"([{"x": 1, "y": 2}, 3])", "The array is invalid!\n"},
+                                        std::pair{R"([{"x": 1, "z": 2}])", "The coordinate is missing!\n"},
+                                        std::pair{R"([{"x": 1, "y": "2"}])", "The coordinate is missing!\n"},
+                                        std::pair{R"([{"x": [1], "y": 2, "z": 3}])", "The coordinate is missing!\n"}})
+        result = result && readError(text) == message;
+
+    std::filesystem::remove(filename, error);
+
+    return result;
+}
+
+inline bool testSquaredDistance() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Квадраты расстояний до этих точек отличаются на единицу, а сами
+    // расстояния после извлечения корня в double совпадают, поэтому
+    // ближайшая точка определяется только по точным квадратам.
+    const Point query{{0, 0}, 0.0};
+    const Point nearest{{2'000'000'000, 0}, 1.0};
+    const Point farthest{{2'000'000'000, 1}, 2.0};
+
+    bool result = nearest.getDistance(query) == farthest.getDistance(query)
+                  && nearest.getSquaredDistance(query) + 1 == farthest.getSquaredDistance(query)
+                  && nearest.getSquaredDistance(farthest, 1) == 1;
+
+    for (bool reverse_search : {false, true})
+        for (const auto& points : {std::vector<Point>{nearest, farthest},
+                                   std::vector<Point>{farthest, nearest}})
+        {
+            auto check = [&](const auto& tree){
+                const auto neighbors = tree.neighborsSearch(query, 1, reverse_search);
+                return neighbors.size() == 1 && neighbors[0].compareExactlyEqual(nearest); };
+
+            // Корзина сравнивает квадраты в double, а в нём оба одинаковы
+            result = result
+                     && check(KdTree{std::vector<Point>{points}})
+                     && check(FlatKdTree{std::vector<Point>{points}})
+                     && check(FlatKdTree{std::vector<Point>{points}, 16});
+        }
+
+    return result;
+}
+
+inline bool testIdwKernels() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    std::mt19937 engine{47};
+    std::uniform_real_distribution<double> squared_distance{1.0, 1.0E6};
+    std::uniform_real_distribution<double> value{-100.0, 100.0};
+
+    // Специализированные степени (целые и полуцелые), обычная степень и
+    // число соседей, кратное и некратное числу дорожек и размеру пачки
+    for (double idw_power : {0.0, 0.5, 1.0, 1.5, 2.0, 2.5, 3.0, 4.0, 7.5, 8.0, 1.7, 10.0})
+        for (std::size_t num_neighbors : {1UL, 3UL, 4UL, 5UL, 64UL, 65UL, 1000UL})
+        {
+            IdwAccumulator accumulator{idw_power};
+            long double num = 0.0L, den = 0.0L;
+            for (std::size_t i = 0; i < num_neighbors; ++i)
+            {
+                const double distance = squared_distance(engine);
+                const double neighbor_value = value(engine);
+                accumulator.add(distance, neighbor_value);
+
+                const long double weight = std::pow(static_cast<long double>(distance),
+                                                    -0.5L * idw_power);
+                num += weight * neighbor_value;
+                den += weight;
+            }
+
+            const double expected = static_cast<double>(num / den);
+            if (std::abs(accumulator.getMean() - expected) > 1.0E-12 * std::max(std::abs(expected), 1.0))
+                return false;
+        }
+
+    // Взаимное уничтожение больших значений: без компенсации малые значения
+    // теряются, причём как в одной дорожке (первый набор - по дорожкам
+    // 1E16, 1, -1E16), так и при сложении дорожек (второй набор). Сборка с
+    // -ffast-math проверяет, что компенсация не выброшена оптимизатором.
+    for (const auto& values : {std::vector<double>{1.0E16, 1.0E16, 1.0E16, 1.0E16,
+                                                   1.0, 1.0, 1.0, 1.0,
+                                                   -1.0E16, -1.0E16, -1.0E16, -1.0E16},
+                               std::vector<double>{1.0E16, 1.0, -1.0E16}})
+        for (double idw_power : {1.0, 2.0, 1.7})
+        {
+            IdwAccumulator accumulator{idw_power};
+            for (double neighbor_value : values)
+                accumulator.add(1.0, neighbor_value);
+
+            // Веса всех соседей равны, а среднее обоих наборов - 1/3
+            if (std::abs(accumulator.getMean() - 1.0 / 3.0) > 1.0E-12)
+                return false;
+        }
+
+    return true;
+}
+
+inline bool testNeighborVisitor() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{53};
+    const auto points = makeRandomPoints<Point>(3000, engine);
+    auto queries = makeRandomPoints<Point>(100, engine);
+    // Совпадающая с известной точка (нулевое расстояние)
+    queries.push_back(points[17]);
+
+    auto check = [&queries](const auto& tree){
+        using Tree = std::decay_t<decltype(tree)>;
+
+        for (bool reverse_search : {false, true})
+            for (const auto& query : queries)
+            {
+                // Соседи посетителя те же и в том же порядке, что и в векторе,
+                // а указатели ведут на точки самого дерева, а не на копии
+                const auto expected = tree.neighborsSearch(query, 12, reverse_search);
+                std::vector<const Point*> neighbors;
+                typename Tree::SquaredDistance last_distance{};
+                bool is_sorted = true;
+                const auto count = tree.visitNeighbors(query, 12, reverse_search,
+                    [&](typename Tree::SquaredDistance distance, const Point* neighbor){
+                        is_sorted = is_sorted
+                                    && !(distance < last_distance)
+                                    && distance == neighbor->getSquaredDistance(query);
+                        last_distance = distance;
+                        neighbors.push_back(neighbor); });
+
+                std::vector<const Point*> same_neighbors;
+                tree.visitNeighbors(query, 12, reverse_search, [&same_neighbors](auto, const Point* neighbor){
+                    same_neighbors.push_back(neighbor); });
+
+                if (count != expected.size()
+                    || !is_sorted
+                    || neighbors != same_neighbors
+                    || !std::equal(neighbors.begin(), neighbors.end(), expected.begin(), expected.end(),
+                                   [](const Point* lhs, const Point& rhs){
+                                       return lhs->compareExactlyEqual(rhs); }))
+                    return false;
+
+                // Значение без соседей совпадает со значением с соседями,
+                // а соседи копируются, только если их попросили
+                Point point = query;
+                const auto shepard_neighbors = tree.shepardInterpolation(point, 12, reverse_search, 2.0);
+                std::vector<Point> dump;
+                if (!isEqual(tree.interpolate(query, 12, reverse_search, 2.0), point.getValue())
+                    || !isEqual(tree.interpolate(query, 12, reverse_search, 2.0, 0.0, &dump), point.getValue())
+                    || !compareNeighbors(dump, shepard_neighbors))
+                    return false;
+            }
+
+        // Без вектора результата памяти нужно меньше, чем поиску с вектором,
+        // а плоскому дереву при числе соседей не больше встроенной ёмкости
+        // кучи она не нужна совсем
+        std::size_t base_allocations = num_allocations;
+        tree.visitNeighbors(queries.front(), 12, false, [](auto, const Point*){});
+        tree.interpolate(queries.front(), 12, false, 2.0);
+        const std::size_t visit_allocations = num_allocations - base_allocations;
+
+        base_allocations = num_allocations;
+        tree.neighborsSearch(queries.front(), 12, false);
+        Point point = queries.front();
+        tree.shepardInterpolation(point, 12, false, 2.0);
+        const std::size_t search_allocations = num_allocations - base_allocations;
+
+        if (visit_allocations >= search_allocations
+            || (std::is_same_v<Tree, FlatKdTree<Point>> && visit_allocations != 0))
+            return false;
+
+        // Без соседей значение точки не меняется
+        const Point query{{1, 2}, 3.0};
+        return tree.visitNeighbors(query, 0, false, [](auto, const Point*){}) == 0
+               && isEqual(tree.interpolate(query, 0, false, 2.0), 3.0)
+               && isEqual(Tree{}.interpolate(query, 12, false, 2.0), 3.0); };
+
+    return check(KdTree{std::vector<Point>{points}})
+           && check(FlatKdTree{std::vector<Point>{points}})
+           && check(FlatKdTree{std::vector<Point>{points}, 16});
+}
+
+inline bool testQueryWorkspace() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    // Без замены operator new счётчик не растёт, и проверка ниже ничего не значит
+    const std::size_t hook_allocations = num_allocations;
+    ::operator delete(::operator new(1));
+    if (num_allocations == hook_allocations)
+        return false;
+
+    std::mt19937 engine{59};
+    const auto points = makeRandomPoints<Point>(5000, engine);
+    const auto queries = makeRandomPoints<Point>(40, engine);
+
+    constexpr std::size_t max_neighbors = 1000;
+    constexpr std::size_t num_threads = 4;
+
+    // Потоки одновременно ищут соседей каждый со своим пространством. После
+    // прогрева при наибольшем числе соседей запросы с любым числом соседей,
+    // то больше, то меньше встроенной ёмкости кучи, не выделяют память, а
+    // ответ тот же, что и у полного перебора и у запроса без пространства.
+    // Счётчик выделений у каждого потока свой.
+    auto check = [&](const auto& tree){
+        std::vector<char> results(num_threads, false);
+        {
+            std::latch start{num_threads};
+            std::vector<std::jthread> threads;
+            for (std::size_t t = 0; t < num_threads; ++t)
+                threads.emplace_back([&, t](){
+                    typename std::decay_t<decltype(tree)>::QueryWorkspace workspace;
+                    for (bool reverse_search : {false, true})
+                        tree.interpolate(workspace, queries.front(), max_neighbors, reverse_search, 2.0);
+
+                    std::vector<Point> neighbors;
+                    neighbors.reserve(max_neighbors);
+
+                    start.arrive_and_wait();
+
+                    bool result = true;
+                    std::size_t num_query_allocations = 0;
+                    for (std::size_t num_neighbors : {max_neighbors, 5UL, 100UL, 40UL, 3UL, 200UL})
+                        for (bool reverse_search : {false, true})
+                            for (const auto& query : queries)
+                            {
+                                neighbors.clear();
+                                const std::size_t base_allocations = num_allocations;
+                                tree.visitNeighbors(workspace, query, num_neighbors, reverse_search,
+                                                    [&neighbors](auto, const Point* neighbor){
+                                                        neighbors.push_back(*neighbor); });
+                                const double value = tree.interpolate(workspace, query, num_neighbors,
+                                                                      reverse_search, 2.0);
+                                num_query_allocations += num_allocations - base_allocations;
+
+                                result = result
+                                         && checkNeighbors(neighbors, points, query, num_neighbors)
+                                         && isEqual(value, tree.interpolate(query, num_neighbors,
+                                                                            reverse_search, 2.0));
+                            }
+
+                    results[t] = result && num_query_allocations == 0;
+                });
+        }
+
+        return std::find(results.begin(), results.end(), false) == results.end(); };
+
+    return check(KdTree{std::vector<Point>{points}})
+           && check(FlatKdTree{std::vector<Point>{points}, 8});
+}
+
+inline bool testIterativeSearch() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    std::mt19937 engine{61};
+
+    // Отложенные ветви отсеиваются при снятии со стека по расстоянию до
+    // плоскости, запомненному при спуске. Узкие места - совпадающие
+    // расстояния (точки сетки, где ветвь на границе нельзя отбросить, пока
+    // куча не полна), приближённый поиск, где граница отсева умножается на
+    // (1 + approx_epsilon), и узлы только с одним поддеревом (деревья из
+    // нескольких точек и KdTree, собранное вставкой по одной точке
+    // в порядке возрастания координат).
+    std::vector<std::vector<Point>> point_sets;
+    for (std::size_t num_points : {1UL, 2UL, 3UL, 7UL, 100UL, 1000UL})
+        point_sets.push_back(makeRandomPoints<Point>(num_points, engine));
+
+    auto& grid = point_sets.emplace_back();
+    for (int x = 0; x < 30; ++x)
+        for (int y = 0; y < 30; ++y)
+            grid.push_back({{x, y}, static_cast<double>(x * 30 + y)});
+
+    auto queries = makeRandomPoints<Point>(10, engine);
+    for (int i = 0; i < 10; ++i)
+        queries.push_back({{i * 3, 29 - i * 2}, 0.0});
+
+    auto check = [&queries](const auto& tree, const std::vector<Point>& points){
+        for (const auto& query : queries)
+            for (std::size_t num_neighbors : {1UL, 5UL, 40UL, points.size() + 1})
+                for (bool reverse_search : {false, true})
+                    for (double approx_epsilon : {0.0, 0.5})
+                        if (!checkNeighbors(tree.neighborsSearch(query, num_neighbors, reverse_search, approx_epsilon),
+                                            points,
+                                            query,
+                                            num_neighbors,
+                                            approx_epsilon))
+                            return false;
+
+        return true; };
+
+    bool result = true;
+    for (const auto& points : point_sets)
+    {
+        KdTree<Point> inserted_tree;
+        auto sorted = points;
+        std::sort(sorted.begin(), sorted.end(), [](const Point& lhs, const Point& rhs){
+            return lhs.compareLess(rhs); });
+        for (auto& point : sorted)
+            inserted_tree.insert(std::move(point));
+
+        result = result
+                 && check(KdTree{std::vector<Point>{points}}, points)
+                 && check(inserted_tree, points)
+                 && check(FlatKdTree{std::vector<Point>{points}}, points)
+                 && check(FlatKdTree{std::vector<Point>{points}, 5}, points);
+    }
+
+    return result;
+}
+
+inline bool testDuplicatePoints() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    // Ожидаемый результат: точка остаётся, если
+    // среди предыдущих нет равной ей по координатам
+    auto removeDuplicates = [](const auto& points){
+        std::remove_cvref_t<decltype(points)> unique_points;
+        for (std::size_t i = 0; i < points.size(); ++i)
+            if (std::none_of(points.begin(), points.begin() + i,
+                             [&point = points[i]](const auto& other){
+                                 return other.compareEqual(point); }))
+                unique_points.push_back(points[i]);
+        return unique_points; };
+
+    std::mt19937 engine{43};
+    std::uniform_int_distribution<int> coord{-20, 20};
+
+    // Целые координаты в узком диапазоне - повторов много
+    std::vector<Point<int, double, NUM_DIMS>> int_points;
+    for (std::size_t i = 0; i < 3000; ++i)
+        int_points.push_back({{coord(engine), coord(engine)}, static_cast<double>(i)});
+
+    // Координаты с плавающей точкой, отличающиеся меньше чем на эпсилон
+    std::vector<Point<double, double, NUM_DIMS>> float_points;
+    for (std::size_t i = 0; i < 3000; ++i)
+        float_points.push_back({{coord(engine) + (i % 3) * 1.0E-10,
+                                 coord(engine) - (i % 5) * 1.0E-10},
+                                static_cast<double>(i)});
+
+    auto expected_int_points = removeDuplicates(int_points);
+    auto expected_float_points = removeDuplicates(float_points);
+
+    removeDuplicatePoints(int_points);
+    removeDuplicatePoints(float_points);
+
+    auto compareExactlyEqual = [](const auto& lhs, const auto& rhs){
+        return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                          [](const auto& lhs, const auto& rhs){
+                              return lhs.compareExactlyEqual(rhs); }); };
+
+    return expected_int_points.size() < 3000
+           && compareExactlyEqual(int_points, expected_int_points)
+           && expected_float_points.size() < 3000
+           && compareExactlyEqual(float_points, expected_float_points);
+}
+
+inline bool testResultWriter() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Point = Point<int, double, NUM_DIMS>;
+
+    constexpr std::array axis_names{"x", "y"};
+
+    std::mt19937 engine{43};
+    auto points = makeRandomPoints<Point>(3000, engine);
+    std::uniform_real_distribution<double> value{-1.0E6, 1.0E6};
+    for (auto& point : points)
+        point.setValue(value(engine));
+    // Целые, очень малые и очень большие значения
+    points[0].setValue(2.0);
+    points[1].setValue(-1.0E-7);
+    points[2].setValue(1.5E300);
+    points[3].setValue(0.1);
+
+    std::error_code error;
+    const auto directory = std::filesystem::temp_directory_path(error);
+    const auto expected_fn = (directory / "proximal_writer_expected.json").string();
+    const auto output_fn = (directory / "proximal_writer_output.json").string();
+
+    auto readFile = [](const std::string& filename){
+        std::ifstream file{filename, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()}; };
+
+    // Файл тот же, что и у writePoints() (т.е. у nlohmann::json), с точностью
+    // до представления чисел, которые читаются в те же самые значения
+    auto parseFile = [&readFile](const std::string& filename){
+        return nlohmann::json::parse(readFile(filename)); };
+
+    bool result = true;
+    for (int json_indent : {-1, 0, 4})
+        for (std::size_t num_points : {0UL, 1UL, points.size()})
+        {
+            const std::vector<Point> part{points.begin(), points.begin() + num_points};
+            writePoints(expected_fn, part, json_indent, axis_names, "value");
+
+            JsonPointsWriter<int, double, NUM_DIMS> writer{output_fn, json_indent, axis_names, "value"};
+            for (const auto& point : part)
+                writer.write(point);
+
+            result = result
+                     && writer.close()
+                     && readFile(output_fn).size() <= readFile(expected_fn).size()
+                     && parseFile(output_fn) == parseFile(expected_fn);
+        }
+
+    // Не число и бесконечности записываются как null и в сборке с -Ofast
+    {
+        std::vector<Point> special{points.begin(), points.begin() + 3};
+        special[0].setValue(std::numeric_limits<double>::quiet_NaN());
+        special[1].setValue(std::numeric_limits<double>::infinity());
+        special[2].setValue(-std::numeric_limits<double>::infinity());
+
+        JsonPointsWriter<int, double, NUM_DIMS> writer{output_fn, 4, axis_names, "value"};
+        for (const auto& point : special)
+            writer.write(point);
+
+        result = result && writer.close();
+
+        const auto json = nlohmann::json::parse(readFile(output_fn), nullptr, false);
+        result = result
+                 && !json.is_discarded()
+                 && json.size() == special.size()
+                 && std::all_of(json.begin(), json.end(), [](const nlohmann::json& object){
+                        return object.contains("value") && object.at("value").is_null(); });
+    }
+
+    // Пакетная интерполяция отдаёт точки приёмнику в исходном порядке
+    // независимо от числа потоков и порядка обработки, в том числе
+    // совпадающие искомые точки, которые обрабатывают разные потоки
+    const KdTree tree{std::vector<Point>{points}};
+    auto queries = makeRandomPoints<Point>(2000, engine);
+    queries.insert(queries.end(), queries.begin(), queries.begin() + 500);
+
+    struct Sink
+    {
+        void write(const Point& point)
+        {
+            points.push_back(point);
+        }
+
+        std::vector<Point> points;
+    };
+
+    std::vector<Point> expected;
+    for (auto point : queries)
+    {
+        tree.shepardInterpolation(point, 8, false, 2.0);
+        expected.push_back(point);
+    }
+
+    for (bool morton_order : {false, true})
+    {
+        auto batch = queries;
+        Sink sink;
+        result = result
+                 && shepardInterpolation(tree, batch, 8, false, 0.0, 2.0, 0.0, 3,
+                                         morton_order, -1, axis_names, "value", sink)
+                 && compareNeighbors(sink.points, expected);
+    }
+
+    // Исключение из приёмника останавливает вызов: приёмник получает только
+    // точки до него и в исходном порядке, после него записей больше нет
+    struct FailingSink
+    {
+        void write(const Point& point)
+        {
+            if (points.size() == num_written)
+                throw std::runtime_error{"The sink failed!"};
+
+            points.push_back(point);
+        }
+
+        std::size_t num_written;
+        std::vector<Point> points;
+    };
+
+    for (std::size_t num_written : {0UL, 1UL, 777UL})
+    {
+        auto batch = queries;
+        FailingSink sink{num_written, {}};
+        result = result
+                 && !shepardInterpolation(tree, batch, 8, false, 0.0, 2.0, 0.0, 3,
+                                          false, -1, axis_names, "value", sink)
+                 && compareNeighbors(sink.points, std::vector<Point>{expected.begin(),
+                                                                     expected.begin() + num_written});
+    }
+
+    std::filesystem::remove(expected_fn, error);
+    std::filesystem::remove(output_fn, error);
+
+    return result;
+}
+
+inline bool unitTests() noexcept
+{
+#ifndef NDEBUG
+    DEBUG_INFO();
+#endif
+
+    using Array = int[];
+    using Point = Point<int, double, NUM_DIMS>;
+
+    KdTree tree = KdTree(std::vector<Point>{
+        {{8, 34, 88}, 89.6548L},
+        {{-3}, 58.3256},
+        {{-9.0L, 8.0L}, 8.36633},
+        Point{Array{45, 65}, 4.7921F},
+        Point{Array{21, -12}, -5.81225},
+        Point{Array{0, 77}, 13.03254185L},
+        Point{Array{65, 42}, -69.00115},
+        Point{Array{13, -24}, 80.41564},
+        Point{Array{55, 33}, -22.1515F},
+        Point{Array{94, -65}, 42.648955},
+        {{-32, -11}, -3.5135F}
+    });
+
+    std::cout << tree << '\n';
+
+    if (tree.isEmpty())
+        return false;
+
+    if (!tree.remove(Point{{-3, 0}}) ||
+        !tree.insert({{1, 1}, -45.102548}) ||
+        !tree.insert({{50, 75}, 10.201111}) ||
+        !tree.remove(Point{{45, 65}}) ||
+        !tree.insert({{60, 80}, 2.718281828459045}) ||
+#ifndef ALLOW_DUPLICATE_POINTS
+         tree.insert({{60, 80}, 0.0}) ||
+#endif
+         tree.remove(Point{{99, 99}}))
+        return false;
+
+    std::cout << tree << '\n';
+
+    const double ref_value = -43.91734030;
+    const std::size_t num_neighbors = 4UL;
+    if (!testNnsSearchAndIdwInterpolation(tree, num_neighbors, ref_value))
+        return false;
+
+    // Тот же набор точек, что и в дереве выше после всех изменений
+    std::vector<Point> points{
+        {{8, 34}, 89.6548L},
+        {{-9, 8}, 8.36633},
+        {{21, -12}, -5.81225},
+        {{0, 77}, 13.03254185L},
+        {{65, 42}, -69.00115},
+        {{13, -24}, 80.41564},
+        {{55, 33}, -22.1515F},
+        {{94, -65}, 42.648955},
+        {{-32, -11}, -3.5135F},
+        {{1, 1}, -45.102548},
+        {{50, 75}, 10.201111},
+        {{60, 80}, 2.718281828459045}
+    };
+
+    FlatKdTree flat_tree = FlatKdTree(std::vector<Point>{points});
+
+    std::cout << flat_tree << '\n';
+
+    if (flat_tree.isEmpty()
+        || flat_tree.getSize() != points.size()
+        || !testNnsSearchAndIdwInterpolation(flat_tree, num_neighbors, ref_value))
+        return false;
+
+    // Листья-корзины до 5 точек: проверяется и векторизованный
+    // просмотр целой корзины, и её неполный остаток (хвост).
+    FlatKdTree bucket_tree = FlatKdTree(std::move(points), 5);
+
+    std::cout << bucket_tree << '\n';
+
+    if (bucket_tree.getLeafSize() != 5UL
+        || !testNnsSearchAndIdwInterpolation(bucket_tree, num_neighbors, ref_value))
+        return false;
+
+    if (!testParallelBuild()
+        || !testConcurrentSearch()
+        || !testMortonOrder()
+        || !testBoundedHeap()
+        || !testRadiusSearch()
+        || !testApproxSearch()
+        || !testBestBinFirstSearch()
+        || !testDynamicBalance()
+#ifndef ALLOW_DUPLICATE_POINTS
+        || !testBatchUpdate()
+#endif
+        || !testTombstones()
+        || !testSnapshots()
+        || !testSnapshotPathCopies()
+        || !testTreeFile()
+        || !testBinaryPoints()
+        || !testJsonPoints()
+        || !testSquaredDistance()
+        || !testIdwKernels()
+        || !testNeighborVisitor()
+        || !testQueryWorkspace()
+        || !testIterativeSearch()
+        || !testDuplicatePoints()
+        || !testResultWriter())
+        return false;
+
+    return true;
+}
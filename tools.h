@@ -2,14 +2,20 @@
 
 #include <cmath>
 
+#include <span>
 #include <array>
 #include <vector>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <barrier>
+#include <algorithm>
+#include <type_traits>
 
 #include <exception>
 
-#include <nlohmann/json.hpp>
-
 #ifndef NDEBUG
 #include <filesystem>
 #include "io.h"
@@ -18,86 +24,305 @@
 #include "kdtree.h"
 #include "point.h"
 #include "utils.h"
+#include "morton.h"
+#include "idw_kernels.h"
+
+// Число искомых точек, которые обрабатываются вместе, пока предыдущие
+// такие же точки записываются в приёмник результата
+inline constexpr std::size_t INTERPOLATION_WINDOW_SIZE = 1UL << 16;
+
+// Потоки разбирают окно частями по столько точек
+inline constexpr std::size_t INTERPOLATION_CHUNK_SIZE = 1UL << 8;
 
-template<class C, class V, std::size_t N>
+// Соседи - это сами точки или указатели на них (например, результат
+// поиска в радиусе), причём порядок соседей значения не имеет.
+template<class C, class V, std::size_t N, class Neighbor>
+requires std::is_same_v<std::remove_cv_t<std::remove_pointer_t<Neighbor>>, Point<C, V, N>>
 V shepardInterpolation(const Point<C, V, N>& point,
-                       const std::vector<Point<C, V, N>>& neighbors,
+                       const std::vector<Neighbor>& neighbors,
                        double idw_power = 2.0) noexcept
 {
-    long double num = 0.0L, den = 0.0L;
-    for (const auto& neighbor : neighbors)
+    // Вес вычисляется прямо из квадрата расстояния (см. IdwKernel)
+    IdwAccumulator accumulator{idw_power};
+    for (const auto& element : neighbors)
     {
-        const auto distance = neighbor.getDistance(point);
+        const Point<C, V, N>* neighbor;
+        if constexpr (std::is_pointer_v<Neighbor>)
+            neighbor = element;
+        else
+            neighbor = &element;
+
+        const auto distance = neighbor->getSquaredDistance(point);
 #ifdef ZERO_DISTANCE_HANDLING
-        if (isZero(distance)) [[unlikely]]
-            return neighbor.getValue();
+        if (isZeroSquared(distance)) [[unlikely]]
+            return neighbor->getValue();
 
-        const auto weight = 1.0 / std::pow(distance, idw_power);
+        const auto squared_distance = static_cast<double>(distance);
 #else
-        const auto weight = 1.0 / std::pow(isZero(distance) ? EPSILON<decltype(distance)>
-                                                            : distance,
-                                           idw_power);
+        constexpr auto epsilon = EPSILON<decltype(point.getDistance(point))>;
+        const auto squared_distance = isZeroSquared(distance) ? static_cast<double>(epsilon * epsilon)
+                                                              : static_cast<double>(distance);
 #endif
-        num += weight * neighbor.getValue();
-        den += weight;
+        accumulator.add(squared_distance, static_cast<double>(neighbor->getValue()));
     }
 
-    if constexpr (!std::is_same_v<decltype(num), V>)
-        return static_cast<V>(num / den);
+    if constexpr (!std::is_same_v<double, V>)
+        return static_cast<V>(accumulator.getMean());
     else
-        return num / den;
+        return accumulator.getMean();
 }
 
-template<class C, class V, std::size_t N>
-std::string shepardInterpolation(const KdTree<Point<C, V, N>>& tree,
-                                 std::vector<Point<C, V, N>>& points,
-                                 std::size_t num_neighbors,
-                                 bool reverse_search,
-                                 double idw_power,
-                                 int json_indent,
-                                 const std::array<const char*, N>& axis_names,
-                                 const char* value_name) noexcept
+// Искомые точки обрабатываются окнами по INTERPOLATION_WINDOW_SIZE точек в
+// исходном порядке. Потоки (num_threads - 1 рабочих и текущий) создаются один
+// раз на весь вызов и разбирают каждое окно частями по
+// INTERPOLATION_CHUNK_SIZE точек через общий счётчик, записывая значения
+// прямо в точки (каждая точка принадлежит ровно одной части). Ещё один поток
+// передаёт готовые окна приёмнику sink (метод write() для каждой точки в
+// исходном порядке), пока обрабатываются следующие окна, так что запись
+// результата идёт одновременно с вычислениями, а сам результат не зависит от
+// числа потоков. После первого исключения в любом потоке, в том числе из
+// приёмника, остальные потоки останавливаются, а приёмник больше не получает
+// новых окон. Если задан morton_order, то точки окна обрабатываются в порядке
+// обхода кривой Мортона: соседние запросы проходят по дереву почти одними
+// путями, а каждая часть окна пространственно компактна.
+// Если approx_epsilon больше нуля, то соседи ищутся приближённо: каждый из
+// них не более чем в (1 + approx_epsilon) раз дальше настоящего.
+// Если search_radius больше нуля, то вместо num_neighbors ближайших соседей
+// берутся все известные точки не дальше него, а точки, у которых таких нет,
+// сохраняют исходное значение.
+// Параметры json_indent, axis_names и value_name нужны только отладочной
+// сборке, которая сохраняет соседей каждой точки в отдельный файл.
+template<template<class> class Tree, class C, class V, std::size_t N, class Sink>
+bool shepardInterpolation(const Tree<Point<C, V, N>>& tree,
+                          std::vector<Point<C, V, N>>& points,
+                          std::size_t num_neighbors,
+                          bool reverse_search,
+                          double approx_epsilon,
+                          double idw_power,
+                          double search_radius,
+                          std::size_t num_threads,
+                          bool morton_order,
+                          [[maybe_unused]] int json_indent,
+                          [[maybe_unused]] const std::array<const char*, N>& axis_names,
+                          [[maybe_unused]] const char* value_name,
+                          Sink& sink) noexcept
 try
 {
-    using json = nlohmann::json;
-
 #ifndef NDEBUG
     std::string path{"out/"};
     path += reverse_search ? "rnns/" : "nns/";
     std::filesystem::create_directories(path);
+
+    // Совпадающие искомые точки пишут соседей в один и тот же
+    // файл, поэтому потоки записывают файлы по очереди
+    std::mutex dump_mutex;
 #endif
 
-    json array = json::array();
-    for (auto& point : points)
-    {
+    using Distance = typename Tree<Point<C, V, N>>::Distance;
+    using Buffer = std::vector<const Point<C, V, N>*>;
+    using Workspace = typename Tree<Point<C, V, N>>::QueryWorkspace;
+
+    auto interpolate = [&](Point<C, V, N>& point,
+                           Buffer& buffer,
+                           Workspace& workspace){
+        if (search_radius > 0.0)
+        {
+            if (tree.radiusSearch(point, static_cast<Distance>(search_radius), buffer) != 0)
+                point.setValue(shepardInterpolation(point, buffer, idw_power));
 #ifndef NDEBUG
-        auto neighbors = 
+            std::vector<Point<C, V, N>> neighbors;
+            for (const auto* neighbor : buffer)
+                neighbors.push_back(*neighbor);
+
+            std::lock_guard lock{dump_mutex};
+            writePoints(path + point.toString() + ".json",
+                        neighbors,
+                        json_indent,
+                        axis_names,
+                        value_name);
 #endif
-        tree.shepardInterpolation(point,
-                                  num_neighbors,
-                                  reverse_search,
-                                  idw_power);
+            return;
+        }
+
+        // Соседи копируются только для отладочной записи в файл
 #ifndef NDEBUG
+        std::vector<Point<C, V, N>> neighbors;
+#endif
+        point.setValue(tree.interpolate(workspace,
+                                        point,
+                                        num_neighbors,
+                                        reverse_search,
+                                        idw_power,
+                                        approx_epsilon
+#ifndef NDEBUG
+                                        , &neighbors
+#endif
+                                        ));
+#ifndef NDEBUG
+        std::lock_guard lock{dump_mutex};
         writePoints(path + point.toString() + ".json",
                     neighbors,
                     json_indent,
                     axis_names,
                     value_name);
 #endif
+    };
+
+    if (points.empty())
+        return true;
+
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    num_threads = std::clamp(num_threads, std::size_t(1), points.size());
+
+    const std::size_t num_windows = (points.size() + INTERPOLATION_WINDOW_SIZE - 1) / INTERPOLATION_WINDOW_SIZE;
+    auto getWindowSize = [&points](std::size_t window){
+        return std::min(INTERPOLATION_WINDOW_SIZE, points.size() - window * INTERPOLATION_WINDOW_SIZE); };
+
+    // Номер окна и порядок его точек меняются, только пока все потоки
+    // обработки ждут на барьере, а части окна раздаёт счётчик
+    std::size_t window = 0;
+    std::vector<std::size_t> order;
+    std::atomic<std::size_t> next_chunk{0};
+
+    auto prepareWindow = [&](){
+        next_chunk = 0;
+        if (morton_order)
+            order = getMortonOrder(std::span<const Point<C, V, N>>{points}
+                                       .subspan(window * INTERPOLATION_WINDOW_SIZE, getWindowSize(window)));
+    };
 
-        json object = json::object();
-        for (std::size_t i = 0; i < N; ++i)
-            object[axis_names[i]] = point.getCoord(i);
-        object[value_name] = point.getValue();
+    // Число окон, готовых к записи в приёмник
+    std::atomic<std::size_t> num_ready{0};
 
-        array.emplace_back(std::move(object));
+    // Первое исключение из любого потока
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+
+    auto fail = [&](std::exception_ptr exception) noexcept {
+        {
+            std::lock_guard lock{error_mutex};
+            if (!error)
+                error = std::move(exception);
+        }
+
+        // Пишущий поток мог ждать окна, которое уже не будет готово
+        failed = true;
+        num_ready = std::numeric_limits<std::size_t>::max();
+        num_ready.notify_all();
+    };
+
+    // Выполняется последним пришедшим на барьер потоком
+    // после того, как обработано всё окно
+    auto finishWindow = [&]() noexcept {
+        if (!failed)
+        {
+            num_ready = window + 1;
+            num_ready.notify_all();
+        }
+
+        if (failed || ++window == num_windows)
+        {
+            window = num_windows;
+
+            return;
+        }
+
+        try
+        {
+            prepareWindow();
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+            window = num_windows;
+        }
+    };
+
+    std::barrier barrier{static_cast<std::ptrdiff_t>(num_threads), finishWindow};
+
+    auto work = [&]() noexcept {
+        // Буфер соседей в радиусе и рабочее пространство поиска ближайших
+        // соседей одни на поток и на все его точки, поэтому после первых
+        // запросов память больше не выделяется
+        Buffer buffer;
+        Workspace workspace;
+
+        while (window < num_windows)
+        {
+            const std::size_t offset = window * INTERPOLATION_WINDOW_SIZE;
+            const std::size_t size = getWindowSize(window);
+
+            try
+            {
+                for (std::size_t first; !failed && (first = next_chunk++ * INTERPOLATION_CHUNK_SIZE) < size;)
+                    for (auto i = first; i < std::min(first + INTERPOLATION_CHUNK_SIZE, size); ++i)
+                        interpolate(points[offset + (order.empty() ? i : order[i])], buffer, workspace);
+            }
+            catch (...)
+            {
+                fail(std::current_exception());
+            }
+
+            barrier.arrive_and_wait();
+        }
+    };
+
+    auto writeWindows = [&]() noexcept {
+        try
+        {
+            for (std::size_t i = 0; i < num_windows; ++i)
+            {
+                for (std::size_t ready; (ready = num_ready) <= i;)
+                    num_ready.wait(ready);
+
+                if (failed)
+                    return;
+
+                const std::size_t offset = i * INTERPOLATION_WINDOW_SIZE;
+                for (std::size_t j = offset; j < offset + getWindowSize(i); ++j)
+                    sink.write(points[j]);
+            }
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+    };
+
+    prepareWindow();
+
+    {
+        // Рабочие потоки завершаются раньше пишущего
+        std::jthread writer{writeWindows};
+        std::vector<std::jthread> workers;
+        workers.reserve(num_threads - 1);
+        for (std::size_t i = 1; i < num_threads; ++i)
+            try
+            {
+                workers.emplace_back(work);
+            }
+            catch (...)
+            {
+                // Несозданные потоки уходят с барьера, чтобы
+                // запущенные не ждали их и остановились
+                fail(std::current_exception());
+                for (; i < num_threads; ++i)
+                    barrier.arrive_and_drop();
+            }
+
+        work();
     }
 
-    return array.dump(json_indent);
+    if (error)
+        std::rethrow_exception(error);
+
+    return true;
 }
 catch (const std::exception& e)
 {
     std::cout << e.what() << std::endl;
 
-    return {};
+    return false;
 }
@@ -94,6 +94,34 @@ isZero(Type x) noexcept
     return ABS(x) < EPSILON<Type>;
 }
 
+// Квадрат расстояния, равный нулю, если само расстояние
+// равно нулю в смысле isZero(), но без извлечения корня
+template<class Type>
+inline
+#ifdef __GNUC__
+__attribute__((always_inline))
+#else
+__forceinline
+#endif
+std::enable_if_t<std::is_integral_v<Type>, bool>
+isZeroSquared(Type x) noexcept
+{
+    return x == Type(0);
+}
+
+template<class Type>
+inline
+#ifdef __GNUC__
+__attribute__((always_inline))
+#else
+__forceinline
+#endif
+std::enable_if_t<std::is_floating_point_v<Type>, bool>
+isZeroSquared(Type x) noexcept
+{
+    return x < EPSILON<Type> * EPSILON<Type>;
+}
+
 template<class Type>
 inline
 #ifdef __GNUC__